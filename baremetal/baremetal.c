@@ -26,6 +26,17 @@ static void nprint( intptr_t ptr )
 	asm volatile( ".option norvc\ncsrrw x0, 0x136, %0\n" : : "r" (ptr));
 }
 
+// Paravirtual memmove/memset, the emulator does the whole thing on the host.
+static void pmemmove( void * dst, const void * src, uint32_t len )
+{
+	asm volatile( ".option norvc\ncsrrw x0, 0x141, %0\ncsrrw x0, 0x142, %1\ncsrrw x0, 0x143, %2\n" : : "r" (dst), "r" (src), "r" (len) : "memory" );
+}
+
+static void pmemset( void * dst, int c, uint32_t len )
+{
+	asm volatile( ".option norvc\ncsrrw x0, 0x141, %0\ncsrrw x0, 0x142, %1\ncsrrw x0, 0x144, %2\n" : : "r" (dst), "r" (c), "r" (len) : "memory" );
+}
+
 static inline uint32_t get_cyc_count() {
 	uint32_t ccount;
 	asm volatile(".option norvc\ncsrr %0, 0xC00":"=r" (ccount));
@@ -60,6 +71,22 @@ int main()
 	nprint( cyclecount / timer );
 	lprint( " Mcyc/s\n");
 
+	// Copy 64kB the slow way, then the paravirtual way.
+	static uint32_t bufa[16384], bufb[16384];
+	pmemset( bufa, 0x5a, sizeof( bufa ) );
+	cyclecount_initial = get_cyc_count();
+	for( i = 0; i < 16384; i++ )
+		bufb[i] = bufa[i];
+	cyclecount = get_cyc_count() - cyclecount_initial;
+	lprint( "64kB copy loop: ");
+	nprint( cyclecount );
+	cyclecount_initial = get_cyc_count();
+	pmemmove( bufb, bufa, sizeof( bufa ) );
+	cyclecount = get_cyc_count() - cyclecount_initial;
+	lprint( " cycles, pmemmove: ");
+	nprint( cyclecount );
+	lprint( " cycles\n");
+
 	lprint("\n");
 	SYSCON = 0x5555; // Power off
 }
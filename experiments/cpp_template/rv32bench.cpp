@@ -0,0 +1,166 @@
+// Runs an image on rv32::Core with the same devices and memory layout as
+// ../../mini-rv32ima/mini-rv32ima.c in "-l -p" mode, so the POWEROFF cycle
+// count must match the C build exactly and only the time should differ.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../mini-rv32ima/mini-rv32ima.hpp"
+#include "../../mini-rv32ima/default64mbdtc.h"
+
+struct BenchBus
+{
+	uint32_t Load( MiniRV32IMAState & s, uint32_t addy )
+	{
+		// No keyboard in benchmark mode.
+		if( addy == 0x10000005 )
+			return 0x60;
+		else if( addy == 0x1100bffc )
+			return s.timerh;
+		else if( addy == 0x1100bff8 )
+			return s.timerl;
+		return 0;
+	}
+
+	uint32_t Store( MiniRV32IMAState & s, uint32_t addy, uint32_t val )
+	{
+		if( addy == 0x10000000 ) //UART 8250 / 16550 Data Buffer
+		{
+			printf( "%c", val );
+			fflush( stdout );
+		}
+		else if( addy == 0x11004004 ) //CLNT
+			s.timermatchh = val;
+		else if( addy == 0x11004000 ) //CLNT
+			s.timermatchl = val;
+		else if( addy == 0x11100000 ) //SYSCON (reboot, poweroff, etc.)
+		{
+			s.pc = s.pc + 4;
+			return val;
+		}
+		return 0;
+	}
+};
+
+struct BenchHooks : rv32::NullHooks
+{
+	void CSRWrite( MiniRV32IMAState & s, uint8_t * image, uint16_t csrno, uint32_t value )
+	{
+		if( csrno == 0x136 )
+		{
+			printf( "%d", value ); fflush( stdout );
+		}
+		if( csrno == 0x137 )
+		{
+			printf( "%08x", value ); fflush( stdout );
+		}
+		else if( csrno == 0x138 )
+		{
+			uint32_t ptr = value - rv32::DefaultConfig::ram_base;
+			while( ptr < rv32::DefaultConfig::ram_size && image[ptr] )
+				putchar( image[ptr++] );
+		}
+		else if( csrno == 0x139 )
+		{
+			putchar( value ); fflush( stdout );
+		}
+	}
+
+	int32_t CSRRead( MiniRV32IMAState & s, uint8_t * image, uint16_t csrno )
+	{
+		return ( csrno == 0x140 ) ? -1 : 0;
+	}
+};
+
+typedef rv32::Core< rv32::DefaultConfig, BenchBus, BenchHooks > BenchCore;
+
+int main( int argc, char ** argv )
+{
+	const uint32_t ram_amt = rv32::DefaultConfig::ram_size;
+	int time_divisor = ( argc > 2 ) ? atoi( argv[2] ) : 1;
+	if( argc < 2 || time_divisor <= 0 )
+	{
+		fprintf( stderr, "Usage: %s [image] [time divisor]\n", argv[0] );
+		return 1;
+	}
+
+	uint8_t * ram_image = (uint8_t*)calloc( ram_amt, 1 );
+	FILE * f = fopen( argv[1], "rb" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: \"%s\" not found\n", argv[1] );
+		return -5;
+	}
+	long flen = fread( ram_image, 1, ram_amt, f );
+	fclose( f );
+	if( flen <= 0 )
+	{
+		fprintf( stderr, "Error: Could not load image.\n" );
+		return -7;
+	}
+
+	// Leave the same room at the end of RAM the C build uses for its core, so
+	// the guest sees an identical memory map.
+	uint32_t dtb_ptr = ram_amt - sizeof( default64mbdtb ) - sizeof( struct MiniRV32IMAState );
+	memcpy( ram_image + dtb_ptr, default64mbdtb, sizeof( default64mbdtb ) );
+	uint32_t * dtb = (uint32_t*)( ram_image + dtb_ptr );
+	if( dtb[0x13c/4] == 0x00c0ff03 )
+		dtb[0x13c/4] = __builtin_bswap32( dtb_ptr );
+
+	BenchCore * core = new BenchCore( ram_image );
+	core->state.pc = rv32::DefaultConfig::ram_base;
+	core->state.regs[11] = dtb_ptr + rv32::DefaultConfig::ram_base;
+	core->state.extraflags |= 3;
+
+	struct timespec t0, t1;
+	clock_gettime( CLOCK_MONOTONIC, &t0 );
+
+	uint64_t lastTime = 0;
+	for( ;; )
+	{
+		uint64_t ccount = ( (uint64_t)core->state.cycleh << 32 ) | core->state.cyclel;
+		uint32_t elapsedUs = ccount / time_divisor - lastTime;
+		lastTime += elapsedUs;
+
+		// Same quantum as mini-rv32ima.c with -l: up to the timer interrupt.
+		uint64_t match = ( (uint64_t)core->state.timermatchh << 32 ) | core->state.timermatchl;
+		uint64_t timer = ( ( (uint64_t)core->state.timerh << 32 ) | core->state.timerl ) + elapsedUs;
+		uint64_t quantum = 65536;
+		if( match && match < timer )
+			quantum = 1024;
+		else if( match && match - timer < 65536 )
+			quantum = ( lastTime + match - timer + 1 ) * time_divisor - ccount;
+		if( quantum > 65536 )
+			quantum = 65536;
+
+		int ret = core->Step( 0, elapsedUs, quantum );
+		if( ret == 1 )
+		{
+			// wfi: skip to the timer interrupt, like mini-rv32ima.c with -l.
+			match = ( (uint64_t)core->state.timermatchh << 32 ) | core->state.timermatchl;
+			timer = ( (uint64_t)core->state.timerh << 32 ) | core->state.timerl;
+			uint64_t wait = ( match >= timer ) ? match - timer + 1 : 0;
+			if( !match )
+				ccount += 1024;
+			else
+				ccount += ( ( wait < 100000 ) ? wait : 100000 ) * time_divisor;
+			core->state.cyclel = ccount;
+			core->state.cycleh = ccount >> 32;
+		}
+		else if( ret == 0x5555 )
+			break;
+		else if( ret )
+		{
+			printf( "Unknown failure %d\n", ret );
+			return -1;
+		}
+	}
+
+	clock_gettime( CLOCK_MONOTONIC, &t1 );
+	printf( "POWEROFF@0x%08x%08x\n", core->state.cycleh, core->state.cyclel );
+	fprintf( stderr, "rv32::Core: %.3f s\n", ( t1.tv_sec - t0.tv_sec ) + ( t1.tv_nsec - t0.tv_nsec ) / 1e9 );
+	return 0;
+}
@@ -0,0 +1,88 @@
+// Cost of reading the guest timebase once per quantum, the way mini-rv32ima.c
+// did it (gettimeofday() / -t) and the ways it can now.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <cpuid.h>
+#include <x86intrin.h>
+
+#define CALLS 10000000
+
+static volatile int time_divisor = 1; // volatile: don't let the division fold.
+static uint64_t tsc_origin, ticks_origin, tsc_scale;
+static uint64_t sink;
+
+static uint64_t OldTicks()
+{
+	struct timeval tv;
+	gettimeofday( &tv, 0 );
+	return ( tv.tv_usec + ((uint64_t)(tv.tv_sec)) * 1000000LL ) / time_divisor;
+}
+
+static uint64_t ClockTicks( clockid_t id )
+{
+	struct timespec ts;
+	clock_gettime( id, &ts );
+	return ( ts.tv_nsec / 1000 + ((uint64_t)(ts.tv_sec)) * 1000000LL ) / time_divisor;
+}
+
+static uint64_t MonotonicTicks() { return ClockTicks( CLOCK_MONOTONIC ); }
+static uint64_t CoarseTicks() { return ClockTicks( CLOCK_MONOTONIC_COARSE ); }
+
+static uint64_t TSCTicks()
+{
+	return ticks_origin + (uint64_t)( ( (unsigned __int128)( __rdtsc() - tsc_origin ) * tsc_scale ) >> 32 );
+}
+
+// Same calibration as InitTimebase() in mini-rv32ima.c.
+static int CalibrateTSC()
+{
+	unsigned a, b, c, d;
+	if( !__get_cpuid( 0x80000007, &a, &b, &c, &d ) || !( d & (1<<8) ) )
+		return 0;
+	struct timespec t0, t1, wait = { 0, 20000000 };
+	clock_gettime( CLOCK_MONOTONIC, &t0 );
+	uint64_t tsc0 = __rdtsc();
+	nanosleep( &wait, 0 );
+	clock_gettime( CLOCK_MONOTONIC, &t1 );
+	uint64_t tsc1 = __rdtsc();
+	uint64_t ns = ( t1.tv_sec - t0.tv_sec ) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	tsc_scale = ( ns << 32 ) / ( ( tsc1 - tsc0 ) * 1000 * time_divisor );
+	tsc_origin = tsc1;
+	ticks_origin = ( t1.tv_nsec / 1000 + t1.tv_sec * 1000000ULL ) / time_divisor;
+	return 1;
+}
+
+static void Time( const char * name, uint64_t (*f)() )
+{
+	struct timespec t0, t1;
+	int i;
+	clock_gettime( CLOCK_MONOTONIC, &t0 );
+	for( i = 0; i < CALLS; i++ )
+		sink += f();
+	clock_gettime( CLOCK_MONOTONIC, &t1 );
+	double ns = ( ( t1.tv_sec - t0.tv_sec ) * 1e9 + ( t1.tv_nsec - t0.tv_nsec ) ) / CALLS;
+	printf( "%-28s %6.1f ns/quantum\n", name, ns );
+}
+
+int main()
+{
+	Time( "gettimeofday (before)", OldTicks );
+	Time( "CLOCK_MONOTONIC (fallback)", MonotonicTicks );
+	Time( "CLOCK_MONOTONIC_COARSE", CoarseTicks );
+	if( CalibrateTSC() )
+	{
+		Time( "TSC (after)", TSCTicks );
+		// How far the two clocks drift apart after a second.
+		struct timespec wait = { 1, 0 };
+		int64_t d0 = (int64_t)( TSCTicks() - MonotonicTicks() );
+		nanosleep( &wait, 0 );
+		int64_t d1 = (int64_t)( TSCTicks() - MonotonicTicks() );
+		printf( "TSC vs CLOCK_MONOTONIC drift: %lld us/s\n", (long long)( d1 - d0 ) );
+	}
+	else
+		printf( "No invariant TSC, mini-rv32ima uses CLOCK_MONOTONIC.\n" );
+	return (int)( sink & 0 );
+}
@@ -1,8 +1,28 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// Paravirtual memmove/memset, only in mini-rv32ima.  There's no MMU, so our
+// pointers are the physical addresses the emulator wants.
+static void pmemmove( void * dst, const void * src, uint32_t len )
+{
+	asm volatile( "csrw 0x141, %0\ncsrw 0x142, %1\ncsrw 0x143, %2\n" : : "r" (dst), "r" (src), "r" (len) : "memory" );
+}
+
+static void pmemset( void * dst, int c, uint32_t len )
+{
+	asm volatile( "csrw 0x141, %0\ncsrw 0x142, %1\ncsrw 0x144, %2\n" : : "r" (dst), "r" (c), "r" (len) : "memory" );
+}
 
 int main( int argc, char ** argv )
 {
 	printf( "Hello, world %08x\n", argc );
 	float ft = 7.3f;
 	printf( "f: %f\n", ft );
+
+	char a[32], b[32];
+	pmemset( a, 0, sizeof( a ) );
+	pmemset( a, '!', 5 );
+	pmemmove( b, a, sizeof( a ) );
+	printf( "pmem: %s\n", b );
 }
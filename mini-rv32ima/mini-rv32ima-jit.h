@@ -0,0 +1,319 @@
+// Copyright 2022 Charles Lohr, you may use this file or any portions herein under any of the BSD, MIT, or CC0 licenses.
+
+#ifndef _MINI_RV32IMA_JIT_H
+#define _MINI_RV32IMA_JIT_H
+
+/**
+	Optional x86-64 backend for the block cache in mini-rv32ima.h.  Don't
+	include this directly, define MINIRV32_JIT before including mini-rv32ima.h.
+
+	Once a block has been entered MINIRV32_JIT_THRESHOLD times, it gets
+	translated to native code in an mmap'd arena.  Guest registers stay in
+	struct MiniRV32IMAState, so the interpreter and translated code can hand
+	off to each other at any instruction.
+
+	Translated code is called as native( state, image ) with the System V
+	ABI.  It returns the number of instructions it retired in the top 32 bits
+	and the next pc in the bottom 32.  It never calls out, never traps, and
+	never touches anything but registers and RAM.  Anything else, including
+	MMIO, CSRs, AMOs and stores into pages we have decoded code from, ends
+	the translated code right before that instruction so the interpreter can
+	deal with it.
+*/
+
+#include <sys/mman.h>
+#include <string.h>
+
+#ifndef MINIRV32_JIT_THRESHOLD
+	#define MINIRV32_JIT_THRESHOLD 16
+#endif
+
+#ifndef MINIRV32_JIT_ARENA_SIZE
+	#define MINIRV32_JIT_ARENA_SIZE (16*1024*1024)
+#endif
+
+// Worst case size of one translated block, way more than we need.
+#define MINIRV32_JIT_MAX_BLOCK_BYTES ( MINIRV32_BLOCK_MAX_OPS * 96 + 64 )
+
+typedef uint64_t (*MiniRV32IMANativeBlock)( struct MiniRV32IMAState * state, uint8_t * image );
+
+#define JIT1( b ) { *(p++) = (uint8_t)(b); }
+#define JIT4( d ) { uint32_t jd = (d); memcpy( p, &jd, 4 ); p += 4; }
+#define JIT8( q ) { uint64_t jq = (q); memcpy( p, &jq, 8 ); p += 8; }
+#define JITREG( r ) ( (r) * 4 ) // Offset of regs[r] in the state struct.
+
+// mov eax/ecx, regs[r]      ( reg is 0 for eax, 1 for ecx )
+#define JIT_LOADREG( reg, r ) { JIT1( 0x8b ); JIT1( 0x47 | ( (reg) << 3 ) ); JIT1( JITREG( r ) ); }
+// mov regs[r], eax
+#define JIT_STOREREG( r ) { JIT1( 0x89 ); JIT1( 0x47 ); JIT1( JITREG( r ) ); }
+// <op> eax, regs[r]
+#define JIT_OPREG( opc, r ) { JIT1( opc ); JIT1( 0x47 ); JIT1( JITREG( r ) ); }
+
+// Leave, with rax = ( count << 32 ) | pc.
+static uint8_t * MiniRV32IMAJitExit( uint8_t * p, uint32_t count, uint32_t pc )
+{
+	JIT1( 0x48 ); JIT1( 0xb8 ); JIT8( ( (uint64_t)count << 32 ) | pc ); // movabs rax, imm64
+	JIT1( 0xc3 ); // ret
+	return p;
+}
+
+// Leave, with the pc in eax.
+static uint8_t * MiniRV32IMAJitExitEAX( uint8_t * p, uint32_t count )
+{
+	JIT1( 0x48 ); JIT1( 0xb9 ); JIT8( (uint64_t)count << 32 ); // movabs rcx, imm64
+	JIT1( 0x48 ); JIT1( 0x09 ); JIT1( 0xc8 ); // or rax, rcx
+	JIT1( 0xc3 ); // ret
+	return p;
+}
+
+// Compute the RAM offset of a load or store into eax, and bail out to the
+// interpreter at instruction k if it's not in RAM.
+static uint8_t * MiniRV32IMAJitAddress( uint8_t * p, struct MiniRV32IMADecoded * d, uint32_t k )
+{
+	uint8_t * jae;
+	JIT_LOADREG( 0, d->rs1 );
+	JIT1( 0x05 ); JIT4( d->imm - MINIRV32_RAM_IMAGE_OFFSET ); // add eax, imm32
+	JIT1( 0x3d ); JIT4( MINI_RV32_RAM_SIZE-3 ); // cmp eax, imm32
+	JIT1( 0x72 ); jae = p; JIT1( 0 ); // jb ok
+	p = MiniRV32IMAJitExit( p, k, d->pc );
+	*jae = p - jae - 1;
+	return p;
+}
+
+static int MiniRV32IMAJitBlock( struct MiniRV32IMADecodeCache * cache, struct MiniRV32IMABlock * b )
+{
+	uint8_t * start;
+	uint8_t * p;
+	uint32_t k;
+
+	if( !cache->jitarena )
+	{
+		cache->jitarena = (uint8_t*)mmap( 0, MINIRV32_JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if( cache->jitarena == MAP_FAILED )
+		{
+			MINIRV32WARN( "JIT: Can't map executable memory, staying interpreted.\n" );
+			return 0;
+		}
+	}
+	if( cache->jitarena == MAP_FAILED )
+		return 0;
+
+	if( cache->jitused + MINIRV32_JIT_MAX_BLOCK_BYTES > MINIRV32_JIT_ARENA_SIZE )
+	{
+		// Out of room, throw away all translations and start over.
+		int i;
+		for( i = 0; i < (1<<MINIRV32_BLOCK_CACHE_BITS); i++ )
+		{
+			cache->blocks[i].native = 0;
+			cache->blocks[i].hits = 0;
+		}
+		cache->jitused = 0;
+	}
+
+	start = p = cache->jitarena + cache->jitused;
+
+	for( k = 0; k < b->len; k++ )
+	{
+		struct MiniRV32IMADecoded * d = &b->ops[k];
+		uint32_t rd = d->rd;
+		switch( d->op )
+		{
+		case MINIRV32_DOP_LI:
+			if( rd ) { JIT1( 0xc7 ); JIT1( 0x47 ); JIT1( JITREG( rd ) ); JIT4( d->imm ); } // mov dword regs[rd], imm32
+			break;
+		case MINIRV32_DOP_JAL:
+			if( rd ) { JIT1( 0xc7 ); JIT1( 0x47 ); JIT1( JITREG( rd ) ); JIT4( d->pc + 4 ); }
+			p = MiniRV32IMAJitExit( p, k + 1, d->imm + 4 );
+			break;
+		case MINIRV32_DOP_JALR:
+			JIT_LOADREG( 0, d->rs1 );
+			JIT1( 0x05 ); JIT4( d->imm ); // add eax, imm32
+			JIT1( 0x83 ); JIT1( 0xe0 ); JIT1( 0xfe ); // and eax, ~1
+			if( rd ) { JIT1( 0xc7 ); JIT1( 0x47 ); JIT1( JITREG( rd ) ); JIT4( d->pc + 4 ); }
+			p = MiniRV32IMAJitExitEAX( p, k + 1 );
+			break;
+		case MINIRV32_DOP_BEQ: case MINIRV32_DOP_BNE: case MINIRV32_DOP_BLT: case MINIRV32_DOP_BGE: case MINIRV32_DOP_BLTU: case MINIRV32_DOP_BGEU:
+		{
+			static const uint8_t jcc[6] = { 0x74, 0x75, 0x7c, 0x7d, 0x72, 0x73 }; // je jne jl jge jb jae
+			uint8_t * taken;
+			JIT_LOADREG( 0, d->rs1 );
+			JIT_OPREG( 0x3b, d->rs2 ); // cmp eax, regs[rs2]
+			JIT1( jcc[d->op - MINIRV32_DOP_BEQ] ); taken = p; JIT1( 0 );
+			p = MiniRV32IMAJitExit( p, k + 1, d->pc + 4 );
+			*taken = p - taken - 1;
+			p = MiniRV32IMAJitExit( p, k + 1, d->imm + 4 );
+			break;
+		}
+		case MINIRV32_DOP_LB: case MINIRV32_DOP_LH: case MINIRV32_DOP_LW: case MINIRV32_DOP_LBU: case MINIRV32_DOP_LHU:
+		{
+			// movsx / movsx / mov / movzx / movzx eax, [rsi+rax]
+			static const uint8_t ld[5][4] = { { 0x0f, 0xbe, 0x04, 0x06 }, { 0x0f, 0xbf, 0x04, 0x06 }, { 0x8b, 0x04, 0x06, 0 },
+				{ 0x0f, 0xb6, 0x04, 0x06 }, { 0x0f, 0xb7, 0x04, 0x06 } };
+			const uint8_t * l = ld[d->op - MINIRV32_DOP_LB];
+			p = MiniRV32IMAJitAddress( p, d, k );
+			JIT1( l[0] ); JIT1( l[1] ); JIT1( l[2] );
+			if( l[3] ) JIT1( l[3] );
+			if( rd ) JIT_STOREREG( rd );
+			break;
+		}
+		case MINIRV32_DOP_SB: case MINIRV32_DOP_SH: case MINIRV32_DOP_SW:
+		{
+			uint8_t * jz;
+			p = MiniRV32IMAJitAddress( p, d, k );
+			// If we have decoded anything from this page, let the interpreter
+			// do the store so it can invalidate.
+			JIT1( 0x89 ); JIT1( 0xc2 ); // mov edx, eax
+			JIT1( 0xc1 ); JIT1( 0xea ); JIT1( 12 ); // shr edx, 12
+			JIT1( 0x81 ); JIT1( 0xe2 ); JIT4( MINIRV32_DECODE_CACHE_PAGE_SLOTS - 1 ); // and edx, imm32
+			JIT1( 0x49 ); JIT1( 0xb8 ); JIT8( (uintptr_t)cache->codepages ); // movabs r8, codepages
+			JIT1( 0x41 ); JIT1( 0x80 ); JIT1( 0x3c ); JIT1( 0x10 ); JIT1( 0x00 ); // cmp byte [r8+rdx], 0
+			JIT1( 0x74 ); jz = p; JIT1( 0 ); // je ok
+			p = MiniRV32IMAJitExit( p, k, d->pc );
+			*jz = p - jz - 1;
+			JIT_LOADREG( 1, d->rs2 );
+			if( d->op == MINIRV32_DOP_SH ) JIT1( 0x66 );
+			JIT1( d->op == MINIRV32_DOP_SB ? 0x88 : 0x89 ); JIT1( 0x0c ); JIT1( 0x06 ); // mov [rsi+rax], cl/cx/ecx
+			break;
+		}
+		case MINIRV32_DOP_ADDI: case MINIRV32_DOP_XORI: case MINIRV32_DOP_ORI: case MINIRV32_DOP_ANDI:
+		{
+			static const uint8_t opc[4] = { 0x05, 0x35, 0x0d, 0x25 }; // add xor or and eax, imm32
+			if( !rd ) break;
+			JIT_LOADREG( 0, d->rs1 );
+			JIT1( opc[d->op == MINIRV32_DOP_ADDI ? 0 : d->op - MINIRV32_DOP_XORI + 1] ); JIT4( d->imm );
+			JIT_STOREREG( rd );
+			break;
+		}
+		case MINIRV32_DOP_SLTI: case MINIRV32_DOP_SLTIU:
+			if( !rd ) break;
+			JIT_LOADREG( 0, d->rs1 );
+			JIT1( 0x3d ); JIT4( d->imm ); // cmp eax, imm32
+			JIT1( 0x0f ); JIT1( d->op == MINIRV32_DOP_SLTI ? 0x9c : 0x92 ); JIT1( 0xc0 ); // setl / setb al
+			JIT1( 0x0f ); JIT1( 0xb6 ); JIT1( 0xc0 ); // movzx eax, al
+			JIT_STOREREG( rd );
+			break;
+		case MINIRV32_DOP_SLLI: case MINIRV32_DOP_SRLI: case MINIRV32_DOP_SRAI:
+		{
+			static const uint8_t sh[3] = { 0xe0, 0xe8, 0xf8 }; // shl shr sar
+			if( !rd ) break;
+			JIT_LOADREG( 0, d->rs1 );
+			JIT1( 0xc1 ); JIT1( sh[d->op - MINIRV32_DOP_SLLI] ); JIT1( d->imm );
+			JIT_STOREREG( rd );
+			break;
+		}
+		case MINIRV32_DOP_ADD: case MINIRV32_DOP_SUB: case MINIRV32_DOP_XOR: case MINIRV32_DOP_OR: case MINIRV32_DOP_AND: case MINIRV32_DOP_MUL:
+			if( !rd ) break;
+			JIT_LOADREG( 0, d->rs1 );
+			switch( d->op )
+			{
+				case MINIRV32_DOP_ADD: JIT_OPREG( 0x03, d->rs2 ); break;
+				case MINIRV32_DOP_SUB: JIT_OPREG( 0x2b, d->rs2 ); break;
+				case MINIRV32_DOP_XOR: JIT_OPREG( 0x33, d->rs2 ); break;
+				case MINIRV32_DOP_OR: JIT_OPREG( 0x0b, d->rs2 ); break;
+				case MINIRV32_DOP_AND: JIT_OPREG( 0x23, d->rs2 ); break;
+				default: JIT1( 0x0f ); JIT_OPREG( 0xaf, d->rs2 ); break; // imul eax, regs[rs2]
+			}
+			JIT_STOREREG( rd );
+			break;
+		case MINIRV32_DOP_SLL: case MINIRV32_DOP_SRL: case MINIRV32_DOP_SRA:
+		{
+			static const uint8_t sh[3] = { 0xe0, 0xe8, 0xf8 }; // shl shr sar eax, cl
+			if( !rd ) break;
+			JIT_LOADREG( 0, d->rs1 );
+			JIT_LOADREG( 1, d->rs2 );
+			JIT1( 0xd3 ); JIT1( sh[d->op == MINIRV32_DOP_SLL ? 0 : d->op - MINIRV32_DOP_SRL + 1] );
+			JIT_STOREREG( rd );
+			break;
+		}
+		case MINIRV32_DOP_SLT: case MINIRV32_DOP_SLTU:
+			if( !rd ) break;
+			JIT_LOADREG( 0, d->rs1 );
+			JIT_OPREG( 0x3b, d->rs2 ); // cmp eax, regs[rs2]
+			JIT1( 0x0f ); JIT1( d->op == MINIRV32_DOP_SLT ? 0x9c : 0x92 ); JIT1( 0xc0 ); // setl / setb al
+			JIT1( 0x0f ); JIT1( 0xb6 ); JIT1( 0xc0 ); // movzx eax, al
+			JIT_STOREREG( rd );
+			break;
+		case MINIRV32_DOP_MULH: case MINIRV32_DOP_MULHSU: case MINIRV32_DOP_MULHU:
+			if( !rd ) break;
+			// 64-bit multiply of the sign or zero extended operands.
+			if( d->op == MINIRV32_DOP_MULHU ) JIT_LOADREG( 0, d->rs1 ) else { JIT1( 0x48 ); JIT1( 0x63 ); JIT1( 0x47 ); JIT1( JITREG( d->rs1 ) ); } // movsxd rax
+			if( d->op == MINIRV32_DOP_MULH ) { JIT1( 0x48 ); JIT1( 0x63 ); JIT1( 0x4f ); JIT1( JITREG( d->rs2 ) ); } else JIT_LOADREG( 1, d->rs2 ); // movsxd rcx
+			JIT1( 0x48 ); JIT1( 0x0f ); JIT1( 0xaf ); JIT1( 0xc1 ); // imul rax, rcx
+			JIT1( 0x48 ); JIT1( 0xc1 ); JIT1( 0xe8 ); JIT1( 32 ); // shr rax, 32
+			JIT_STOREREG( rd );
+			break;
+		case MINIRV32_DOP_DIV: case MINIRV32_DOP_DIVU: case MINIRV32_DOP_REM: case MINIRV32_DOP_REMU:
+		{
+			// Same special cases as the interpreter, divide by zero and
+			// INT_MIN / -1 don't trap.
+			uint32_t isrem = d->op == MINIRV32_DOP_REM || d->op == MINIRV32_DOP_REMU;
+			uint32_t issigned = d->op == MINIRV32_DOP_DIV || d->op == MINIRV32_DOP_REM;
+			uint8_t * jz, * jm1 = 0, * jdone, * jdone2 = 0;
+			if( !rd ) break;
+			JIT_LOADREG( 0, d->rs1 );
+			JIT_LOADREG( 1, d->rs2 );
+			JIT1( 0x85 ); JIT1( 0xc9 ); // test ecx, ecx
+			JIT1( 0x74 ); jz = p; JIT1( 0 ); // jz
+			if( issigned )
+			{
+				JIT1( 0x83 ); JIT1( 0xf9 ); JIT1( 0xff ); // cmp ecx, -1
+				JIT1( 0x74 ); jm1 = p; JIT1( 0 ); // je
+				JIT1( 0x99 ); // cdq
+				JIT1( 0xf7 ); JIT1( 0xf9 ); // idiv ecx
+			}
+			else
+			{
+				JIT1( 0x31 ); JIT1( 0xd2 ); // xor edx, edx
+				JIT1( 0xf7 ); JIT1( 0xf1 ); // div ecx
+			}
+			if( isrem ) { JIT1( 0x89 ); JIT1( 0xd0 ); } // mov eax, edx
+			JIT1( 0xeb ); jdone = p; JIT1( 0 ); // jmp done
+			*jz = p - jz - 1;
+			if( !isrem ) { JIT1( 0xb8 ); JIT4( 0xffffffff ); } // Divide by zero, -1 or rs1.
+			if( issigned )
+			{
+				JIT1( 0xeb ); jdone2 = p; JIT1( 0 ); // jmp done
+				*jm1 = p - jm1 - 1;
+				if( isrem ) { JIT1( 0x31 ); JIT1( 0xc0 ); } // xor eax, eax
+				else { JIT1( 0xf7 ); JIT1( 0xd8 ); } // neg eax, INT_MIN stays INT_MIN
+			}
+			*jdone = p - jdone - 1;
+			if( jdone2 ) *jdone2 = p - jdone2 - 1;
+			JIT_STOREREG( rd );
+			break;
+		}
+		default:
+			// Needs the full decoder, the interpreter takes it from here.
+			p = MiniRV32IMAJitExit( p, k, d->pc );
+			goto done;
+		}
+	}
+
+	if( !MINIRV32_DOP_ENDS_BLOCK( b->ops[b->len-1].op ) )
+		p = MiniRV32IMAJitExit( p, b->len, b->endpc );
+done:
+	cache->jitused += p - start;
+	b->native = start;
+	return 1;
+}
+
+// Is there native code for this block?  Translate it if it's hot enough.
+static inline int MiniRV32IMAJitReady( struct MiniRV32IMADecodeCache * cache, struct MiniRV32IMABlock * b )
+{
+	if( b->native )
+		return 1;
+	if( ++b->hits != MINIRV32_JIT_THRESHOLD )
+		return 0;
+	return MiniRV32IMAJitBlock( cache, b );
+}
+
+#undef JIT1
+#undef JIT4
+#undef JIT8
+#undef JITREG
+#undef JIT_LOADREG
+#undef JIT_STOREREG
+#undef JIT_OPREG
+
+#endif
+
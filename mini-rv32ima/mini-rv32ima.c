@@ -14,16 +14,26 @@ int fail_on_all_faults = 0;
 
 static int64_t SimpleReadNumberInt( const char * number, int64_t defaultNumber );
 static uint64_t GetTimeMicroseconds();
+static void InitTimebase( int divisor );
+static uint64_t GetTimerTicks();
 static void ResetKeyboardInput();
 static void CaptureKeyboardInput();
 static uint32_t HandleException( uint32_t ir, uint32_t retval );
+static int HandleHle( uint32_t pc, uint32_t ir, uint32_t * nextpc );
 static uint32_t HandleControlStore( uint32_t addy, uint32_t val );
+static int quantum_break;
 static uint32_t HandleControlLoad( uint32_t addy );
 static void HandleOtherCSRWrite( uint8_t * image, uint16_t csrno, uint32_t value );
 static int32_t HandleOtherCSRRead( uint8_t * image, uint16_t csrno );
-static void MiniSleep();
+static void MiniSleepUntilKB( uint64_t us );
 static int IsKBHit();
 static int ReadKBByte();
+static uint8_t * AllocateRAM( uint32_t amt );
+static int MapImage( FILE * f, long flen );
+static void ResetRAM();
+#ifdef MINIRV32_GUARD_PAGES
+static uint8_t * AllocateGuardedRAM( uint32_t amt );
+#endif
 
 // This is the functionality we want to override in the emulator.
 //  think of this as the way the emulator's processor is connected to the outside world.
@@ -31,8 +41,11 @@ static int ReadKBByte();
 #define MINIRV32_DECORATE  static
 #define MINI_RV32_RAM_SIZE ram_amt
 #define MINIRV32_IMPLEMENTATION
-#define MINIRV32_POSTEXEC( pc, ir, retval ) { if( retval > 0 ) { if( fail_on_all_faults ) { printf( "FAULT\n" ); return 3; } else retval = HandleException( ir, retval ); } }
-#define MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, val ) if( HandleControlStore( addy, val ) ) return val;
+#define MINIRV32_FAST_FORWARD
+#define MINIRV32_POSTEXEC( pc, ir, retval ) { if( retval > 0 ) { if( retval == 3 && HandleHle( pc, ir, &pc ) ) retval = 0; else if( fail_on_all_faults ) { printf( "FAULT\n" ); return 3; } else retval = HandleException( ir, retval ); } }
+// Syscon leaves the step straight away, so save the cycle count for POWEROFF@.
+#define MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, val ) { if( HandleControlStore( addy, val ) ) { if( CSR( cyclel ) > cycle ) CSR( cycleh )++; SETCSR( cyclel, cycle ); return val; } \
+	if( quantum_break ) { quantum_break = 0; MINIRV32_END_QUANTUM(); } }
 #define MINIRV32_HANDLE_MEM_LOAD_CONTROL( addy, rval ) rval = HandleControlLoad( addy );
 #define MINIRV32_OTHERCSR_WRITE( csrno, value ) HandleOtherCSRWrite( image, csrno, value );
 #define MINIRV32_OTHERCSR_READ( csrno, value ) value = HandleOtherCSRRead( image, csrno );
@@ -44,6 +57,15 @@ struct MiniRV32IMAState * core;
 const char * kernel_command_line = 0;
 
 static void DumpState( struct MiniRV32IMAState * core, uint8_t * ram_image );
+static int LoadHleSymbols( const char * symfile );
+static void PatchHleEntries( uint32_t imagelen );
+static void DumpHleStats();
+static int FDTSetProp( uint8_t * dtb, int space, const char * path, const char * name, const void * val, int len );
+static uint64_t TicksUntilMatch( struct MiniRV32IMAState * core );
+static uint64_t TicksUntilTimer( struct MiniRV32IMAState * core );
+#ifdef MINIRV32_FUSION
+static void DumpFusionStats();
+#endif
 
 int main( int argc, char ** argv )
 {
@@ -57,6 +79,7 @@ int main( int argc, char ** argv )
 	int dtb_ptr = 0;
 	const char * image_file_name = 0;
 	const char * dtb_file_name = 0;
+	const char * hle_file_name = 0;
 	for( i = 1; i < argc; i++ )
 	{
 		const char * param = argv[i];
@@ -72,6 +95,7 @@ int main( int argc, char ** argv )
 				case 'k': if( ++i < argc ) kernel_command_line = argv[i]; break;
 				case 'f': image_file_name = (++i<argc)?argv[i]:0; break;
 				case 'b': dtb_file_name = (++i<argc)?argv[i]:0; break;
+				case 'y': hle_file_name = (++i<argc)?argv[i]:0; break;
 				case 'l': param_continue = 1; fixed_update = 1; break;
 				case 'p': param_continue = 1; do_sleep = 0; break;
 				case 's': param_continue = 1; single_step = 1; break;
@@ -95,41 +119,61 @@ int main( int argc, char ** argv )
 	}
 	if( show_help || image_file_name == 0 || time_divisor <= 0 )
 	{
-		fprintf( stderr, "./mini-rv32imaf [parameters]\n\t-m [ram amount]\n\t-f [running image]\n\t-k [kernel command line]\n\t-b [dtb file, or 'disable']\n\t-c instruction count\n\t-s single step with full processor state\n\t-t time divion base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n" );
+		fprintf( stderr, "./mini-rv32imaf [parameters]\n\t-m [ram amount]\n\t-f [running image]\n\t-k [kernel command line]\n\t-b [dtb file, or 'disable']\n\t-c instruction count\n\t-s single step with full processor state\n\t-t time divion base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n\t-y [kernel symbol table, from objdump -t, to run memcpy etc. on the host]\n" );
 		return 1;
 	}
 
-	ram_image = malloc( ram_amt );
+	if( !fixed_update )
+		InitTimebase( time_divisor );
+
+	if( hle_file_name && LoadHleSymbols( hle_file_name ) )
+		return -5;
+
+#ifdef MINIRV32_GUARD_PAGES
+	ram_image = AllocateGuardedRAM( ram_amt );
+#else
+	ram_image = AllocateRAM( ram_amt );
+#endif
 	if( !ram_image )
 	{
 		fprintf( stderr, "Error: could not allocate system image.\n" );
 		return -4;
 	}
 
-restart:
+	// The image is only read once.  Either it's mapped copy-on-write over the
+	// start of RAM, so ResetRAM() puts it back, or we keep a pristine copy.
+	FILE * f = fopen( image_file_name, "rb" );
+	if( !f || ferror( f ) )
 	{
-		FILE * f = fopen( image_file_name, "rb" );
-		if( !f || ferror( f ) )
-		{
-			fprintf( stderr, "Error: \"%s\" not found\n", image_file_name );
-			return -5;
-		}
-		fseek( f, 0, SEEK_END );
-		long flen = ftell( f );
-		fseek( f, 0, SEEK_SET );
-		if( flen > ram_amt )
-		{
-			fprintf( stderr, "Error: Could not fit RAM image (%ld bytes) into %d\n", flen, ram_amt );
-			return -6;
-		}
-
-		memset( ram_image, 0, ram_amt );
-		if( fread( ram_image, flen, 1, f ) != 1)
+		fprintf( stderr, "Error: \"%s\" not found\n", image_file_name );
+		return -5;
+	}
+	fseek( f, 0, SEEK_END );
+	long flen = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	if( flen > ram_amt )
+	{
+		fprintf( stderr, "Error: Could not fit RAM image (%ld bytes) into %d\n", flen, ram_amt );
+		return -6;
+	}
+	uint8_t * image_cache = 0;
+	if( !MapImage( f, flen ) )
+	{
+		image_cache = malloc( flen );
+		if( !image_cache || fread( image_cache, flen, 1, f ) != 1 )
 		{
 			fprintf( stderr, "Error: Could not load image.\n" );
 			return -7;
 		}
-		fclose( f );
+	}
+	fclose( f );
+
+restart:
+	{
+		ResetRAM();
+		if( image_cache )
+			memcpy( ram_image, image_cache, flen );
+		PatchHleEntries( flen );
 
 		if( dtb_file_name )
 		{
@@ -139,7 +183,7 @@ restart:
 			}
 			else
 			{
-				f = fopen( dtb_file_name, "rb" );
+				FILE * f = fopen( dtb_file_name, "rb" );
 				if( !f || ferror( f ) )
 				{
 					fprintf( stderr, "Error: \"%s\" not found\n", dtb_file_name );
@@ -159,9 +203,18 @@ restart:
 		}
 		else
 		{
-			// Load a default dtb.
-			dtb_ptr = ram_amt - sizeof(default64mbdtb) - sizeof( struct MiniRV32IMAState );
-			memcpy( ram_image + dtb_ptr, default64mbdtb, sizeof( default64mbdtb ) );
+			// Load a default dtb, telling the kernel which extensions we were built with.
+			uint8_t dtb[sizeof( default64mbdtb ) + 64];
+			memcpy( dtb, default64mbdtb, sizeof( default64mbdtb ) );
+			int dtblen = FDTSetProp( dtb, sizeof( dtb ), "/cpus/cpu@0", "riscv,isa", MINIRV32_ISA_STRING, sizeof( MINIRV32_ISA_STRING ) );
+			if( dtblen < 0 )
+			{
+				fprintf( stderr, "Warning: Could not set riscv,isa in the default DTB\n" );
+				memcpy( dtb, default64mbdtb, sizeof( default64mbdtb ) );
+				dtblen = sizeof( default64mbdtb );
+			}
+			dtb_ptr = ram_amt - ( ( dtblen + 3 ) & ~3 ) - sizeof( struct MiniRV32IMAState );
+			memcpy( ram_image + dtb_ptr, dtb, dtblen );
 			if( kernel_command_line )
 			{
 				strncpy( (char*)( ram_image + dtb_ptr + 0xc0 ), kernel_command_line, 54 );
@@ -171,6 +224,11 @@ restart:
 
 	CaptureKeyboardInput();
 
+#ifdef MINIRV32_DECODE_CACHE
+	// RAM was just reloaded, nothing we decoded before is valid.
+	MiniRV32IMAFlushDecodeCache( MINIRV32_DECODE_CACHE_PTR );
+#endif
+
 	// The core lives at the end of RAM.
 	core = (struct MiniRV32IMAState *)(ram_image + ram_amt - sizeof( struct MiniRV32IMAState ));
 	core->pc = MINIRV32_RAM_IMAGE_OFFSET;
@@ -192,34 +250,108 @@ restart:
 
 	// Image is loaded.
 	uint64_t rt;
-	uint64_t lastTime = (fixed_update)?0:(GetTimeMicroseconds()/time_divisor);
+	uint64_t lastTime = (fixed_update)?0:GetTimerTicks();
 	int instrs_per_flip = single_step?1:1024;
-	for( rt = 0; rt < instct+1 || instct < 0; rt += instrs_per_flip )
+	const uint64_t max_quantum = 65536;
+	uint64_t tick_instrs = 64; // Measured instructions per timer tick, to size quanta without -l.
+	uint64_t unmeasured = 0; // Instructions run since the timer last moved.
+	for( rt = 0; rt < instct+1 || instct < 0; )
 	{
 		uint64_t * this_ccount = ((uint64_t*)&core->cyclel);
+		uint64_t startcount = *this_ccount;
 		uint32_t elapsedUs = 0;
 		if( fixed_update )
 			elapsedUs = *this_ccount / time_divisor - lastTime;
 		else
-			elapsedUs = GetTimeMicroseconds()/time_divisor - lastTime;
+			elapsedUs = GetTimerTicks() - lastTime;
 		lastTime += elapsedUs;
+		if( elapsedUs && unmeasured )
+		{
+			tick_instrs = ( tick_instrs * 3 + unmeasured / elapsedUs ) / 4;
+			unmeasured = 0;
+		}
+
+		// Run right up to the timer interrupt.  With -l that's exact, otherwise
+		// aim for halfway there and close in.  Devices that need the host
+		// sooner end the quantum with MINIRV32_END_QUANTUM().
+		uint64_t quantum = instrs_per_flip;
+		if( !single_step )
+		{
+			uint64_t ticks = TicksUntilMatch( core );
+			if( ticks <= elapsedUs )
+				quantum = instrs_per_flip; // Already due, or masked.
+			else if( ticks == ~0ULL || ticks - elapsedUs > max_quantum )
+				quantum = max_quantum;
+			else if( fixed_update )
+				quantum = ( lastTime + ticks - elapsedUs ) * time_divisor - *this_ccount;
+			else
+				quantum = ( ticks - elapsedUs ) * tick_instrs / 2 + 1;
+			if( quantum > max_quantum )
+				quantum = max_quantum;
+			if( instct >= 0 && quantum > instct + 1 - rt )
+				quantum = instct + 1 - rt;
+		}
 
 		if( single_step )
 			DumpState( core, ram_image);
 
-		int ret = MiniRV32IMAStep( core, ram_image, 0, elapsedUs, instrs_per_flip ); // Execute upto 1024 cycles before breaking out.
+		int ret = MiniRV32IMAStep( core, ram_image, 0, elapsedUs, quantum );
+		uint64_t ran = *this_ccount - startcount;
+		if( ret == 0 && !single_step )
+		{
+			// If the guest is spinning, skip over counted loops, or wait for
+			// something to happen.  With -l, the timer comes from the cycle
+			// count, so don't skip past a timer interrupt.
+			uint64_t ticks = TicksUntilTimer( core );
+			uint64_t maxskip = ( fixed_update && ticks != ~0ULL ) ? ticks * time_divisor : 0x7fffffff;
+			ret = MiniRV32IMAFastForward( core, ram_image, ( maxskip > 0x7fffffff ) ? 0x7fffffff : maxskip );
+		}
+		if( ret == 1 && !single_step )
+		{
+			// In wfi or spinning on nothing.  wfi always wakes on the timer, a
+			// spin only if the interrupt gets taken.  A spin without a deadline
+			// might be polling the clock, so look again in a millisecond.
+			uint64_t ticks = ( core->extraflags & 4 ) ? TicksUntilMatch( core ) : TicksUntilTimer( core );
+			uint64_t wait = ( ticks != ~0ULL ) ? ticks : ( core->extraflags & 4 ) ? 100000 : 1000;
+			if( !fixed_update && ticks != ~0ULL )
+			{
+				// The timer was last advanced at the top of this loop.
+				uint64_t late = GetTimerTicks() - lastTime;
+				wait = ( wait > late ) ? wait - late : 0;
+			}
+			if( wait > 100000 ) wait = 100000;
+			if( do_sleep && wait ) MiniSleepUntilKB( wait * time_divisor );
+			if( fixed_update && ticks != ~0ULL )
+				*this_ccount += wait * time_divisor;
+			else
+				*this_ccount += instrs_per_flip;
+			unmeasured = 0;
+			ret = 0;
+		}
+		else
+			unmeasured += ran; // Not counting what was fast-forwarded.
+		rt += ( *this_ccount - startcount ) ? ( *this_ccount - startcount ) : 1;
 		switch( ret )
 		{
 			case 0: break;
-			case 1: if( do_sleep ) MiniSleep(); *this_ccount += instrs_per_flip; break;
 			case 3: instct = 0; break;
 			case 0x7777: goto restart;	//syscon code for restart
-			case 0x5555: printf( "POWEROFF@0x%08x%08x\n", core->cycleh, core->cyclel ); return 0; //syscon code for power-off
+			case 0x5555: //syscon code for power-off
+				printf( "POWEROFF@0x%08x%08x\n", core->cycleh, core->cyclel );
+				DumpHleStats();
+#ifdef MINIRV32_FUSION
+				DumpFusionStats();
+#endif
+				return 0;
 			default: printf( "Unknown failure\n" ); break;
 		}
 	}
 
 	DumpState( core, ram_image);
+	DumpHleStats();
+#ifdef MINIRV32_FUSION
+	DumpFusionStats();
+#endif
 }
 
 
@@ -230,9 +362,28 @@ restart:
 
 #if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
 
+#ifdef MINIRV32_GUARD_PAGES
+#error MINIRV32_GUARD_PAGES needs POSIX signals and mmap.
+#endif
+
 #include <windows.h>
 #include <conio.h>
 
+static uint8_t * AllocateRAM( uint32_t amt )
+{
+	return malloc( amt );
+}
+
+static int MapImage( FILE * f, long flen )
+{
+	return 0;
+}
+
+static void ResetRAM()
+{
+	memset( ram_image, 0, ram_amt );
+}
+
 #define strtoll _strtoi64
 
 static void CaptureKeyboardInput()
@@ -244,9 +395,11 @@ static void ResetKeyboardInput()
 {
 }
 
-static void MiniSleep()
+static void MiniSleepUntilKB( uint64_t us )
 {
-	Sleep(1);
+	uint64_t end = GetTimeMicroseconds() + us;
+	while( !_kbhit() && GetTimeMicroseconds() < end )
+		Sleep(1);
 }
 
 static uint64_t GetTimeMicroseconds()
@@ -261,6 +414,18 @@ static uint64_t GetTimeMicroseconds()
 	return ((uint64_t)li.QuadPart * 1000000LL) / (uint64_t)lpf.QuadPart;
 }
 
+static int timebase_divisor = 1;
+
+static void InitTimebase( int divisor )
+{
+	timebase_divisor = divisor;
+}
+
+static uint64_t GetTimerTicks()
+{
+	return GetTimeMicroseconds() / timebase_divisor;
+}
+
 
 static int IsKBHit()
 {
@@ -313,6 +478,13 @@ static int ReadKBByte()
 #include <unistd.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <time.h>
+#if defined( __x86_64__ ) && defined( __GNUC__ )
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC_TIMEBASE
+#endif
 
 static void CtrlC()
 {
@@ -342,19 +514,66 @@ static void ResetKeyboardInput()
 	tcsetattr(0, TCSANOW, &term);
 }
 
-static void MiniSleep()
+static int is_eofd;
+
+static void MiniSleepUntilKB( uint64_t us )
 {
-	usleep(500);
+	// Don't wake up for a key the guest hasn't picked up yet, or this spins.
+	struct timespec ts = { us / 1000000, ( us % 1000000 ) * 1000 };
+	int watch = !is_eofd && IsKBHit() == 0;
+	fd_set fds;
+	FD_ZERO( &fds );
+	if( watch )
+		FD_SET( 0, &fds );
+	pselect( watch, &fds, 0, 0, &ts, 0 );
 }
 
 static uint64_t GetTimeMicroseconds()
 {
-	struct timeval tv;
-	gettimeofday( &tv, 0 );
-	return tv.tv_usec + ((uint64_t)(tv.tv_sec)) * 1000000LL;
+	// Not gettimeofday(), that jumps when the wall clock gets set.
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_nsec / 1000 + ((uint64_t)(ts.tv_sec)) * 1000000LL;
 }
 
-static int is_eofd;
+static int timebase_divisor = 1;
+#ifdef HAVE_TSC_TIMEBASE
+static uint64_t tsc_origin, ticks_origin, tsc_scale; // ticks = ticks_origin + ( tsc - tsc_origin ) * tsc_scale / 2^32
+#endif
+
+// The guest timer gets read every quantum, so where the TSC ticks at a fixed
+// rate, read that instead of asking the kernel, scaled to timer ticks (us / -t)
+// against CLOCK_MONOTONIC.
+static void InitTimebase( int divisor )
+{
+	timebase_divisor = divisor;
+#ifdef HAVE_TSC_TIMEBASE
+	unsigned a, b, c, d;
+	if( !__get_cpuid( 0x80000007, &a, &b, &c, &d ) || !( d & (1<<8) ) ) // Invariant TSC
+		return;
+	struct timespec t0, t1, wait = { 0, 20000000 };
+	clock_gettime( CLOCK_MONOTONIC, &t0 );
+	uint64_t tsc0 = __rdtsc();
+	nanosleep( &wait, 0 );
+	clock_gettime( CLOCK_MONOTONIC, &t1 );
+	uint64_t tsc1 = __rdtsc();
+	uint64_t ns = ( t1.tv_sec - t0.tv_sec ) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	if( tsc1 <= tsc0 || !ns )
+		return;
+	tsc_scale = ( ns << 32 ) / ( ( tsc1 - tsc0 ) * 1000 * divisor );
+	tsc_origin = tsc1;
+	ticks_origin = ( t1.tv_nsec / 1000 + t1.tv_sec * 1000000ULL ) / divisor;
+#endif
+}
+
+static uint64_t GetTimerTicks()
+{
+#ifdef HAVE_TSC_TIMEBASE
+	if( tsc_scale )
+		return ticks_origin + (uint64_t)( ( (unsigned __int128)( __rdtsc() - tsc_origin ) * tsc_scale ) >> 32 );
+#endif
+	return GetTimeMicroseconds() / timebase_divisor;
+}
 
 static int ReadKBByte()
 {
@@ -377,6 +596,77 @@ static int IsKBHit()
 	return !!byteswaiting;
 }
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Untouched pages of an anonymous mapping cost nothing and read as zero, so
+// a large -m only uses what the guest writes.
+static uint8_t * AllocateRAM( uint32_t amt )
+{
+	uint8_t * ret = mmap( 0, amt, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	return ( ret == MAP_FAILED ) ? 0 : ret;
+}
+
+// Map the image privately over the start of RAM.  The guest's writes go to
+// copies, the file's pages stay in the page cache for every VM running it.
+static int MapImage( FILE * f, long flen )
+{
+	struct stat st;
+	if( flen <= 0 || fstat( fileno( f ), &st ) || !S_ISREG( st.st_mode ) )
+		return 0;
+	if( mmap( ram_image, flen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno( f ), 0 ) != MAP_FAILED )
+		return 1;
+	// A failed MAP_FIXED may have unmapped what was there.
+	if( mmap( ram_image, flen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 ) == MAP_FAILED )
+	{
+		fprintf( stderr, "Error: lost RAM mapping\n" );
+		exit( -4 );
+	}
+	return 0;
+}
+
+// Drop every page we've touched: anonymous ones come back as zeroes, the
+// image's as the file's contents.
+static void ResetRAM()
+{
+	if( madvise( ram_image, ram_amt, MADV_DONTNEED ) )
+		memset( ram_image, 0, ram_amt );
+}
+
+#ifdef MINIRV32_GUARD_PAGES
+
+// See MINIRV32_GUARD_PAGES in mini-rv32ima.h.  Faults anywhere else are real.
+static void GuardFault( int sig, siginfo_t * si, void * ctx )
+{
+	uint8_t * addy = si->si_addr;
+	if( ram_image && addy >= ram_image && addy < ram_image + MINIRV32_GUARD_RESERVE )
+		siglongjmp( MINIRV32_GUARD_PTR->jmp, 1 );
+	signal( SIGSEGV, SIG_DFL );
+}
+
+static uint8_t * AllocateGuardedRAM( uint32_t amt )
+{
+	struct sigaction sa;
+	uint8_t * base;
+	if( amt & 4095 )
+	{
+		fprintf( stderr, "Error: RAM has to be a multiple of 4096 bytes with guard pages.\n" );
+		return 0;
+	}
+	base = mmap( 0, MINIRV32_GUARD_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if( base == MAP_FAILED || mprotect( base, amt, PROT_READ | PROT_WRITE ) )
+		return 0;
+	memset( &sa, 0, sizeof( sa ) );
+	sa.sa_sigaction = GuardFault;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER; // The step doesn't save the signal mask.
+	sigemptyset( &sa.sa_mask );
+	sigaction( SIGSEGV, &sa, 0 );
+	sigaction( SIGBUS, &sa, 0 );
+	return base;
+}
+
+#endif
+
 
 #endif
 
@@ -395,6 +685,24 @@ static uint32_t HandleException( uint32_t ir, uint32_t code )
 	return code;
 }
 
+// How many timer ticks until timermatch is passed, ~0 if it's not set.
+static uint64_t TicksUntilMatch( struct MiniRV32IMAState * core )
+{
+	uint64_t timer = ((uint64_t)core->timerh << 32) | core->timerl;
+	uint64_t match = ((uint64_t)core->timermatchh << 32) | core->timermatchl;
+	if( !match )
+		return ~0ULL;
+	return ( match >= timer ) ? match - timer + 1 : 0;
+}
+
+// How many timer ticks until the timer interrupt fires, ~0 if it can't.
+static uint64_t TicksUntilTimer( struct MiniRV32IMAState * core )
+{
+	if( !( core->mie & 0x80 ) || !( core->mstatus & 0x8 ) )
+		return ~0ULL;
+	return TicksUntilMatch( core );
+}
+
 static uint32_t HandleControlStore( uint32_t addy, uint32_t val )
 {
 	if( addy == 0x10000000 ) //UART 8250 / 16550 Data Buffer
@@ -403,9 +711,15 @@ static uint32_t HandleControlStore( uint32_t addy, uint32_t val )
 		fflush( stdout );
 	}
 	else if( addy == 0x11004004 ) //CLNT
+	{
 		core->timermatchh = val;
+		quantum_break = 1; // The quantum was sized for the old deadline.
+	}
 	else if( addy == 0x11004000 ) //CLNT
+	{
 		core->timermatchl = val;
+		quantum_break = 1;
+	}
 	else if( addy == 0x11100000 ) //SYSCON (reboot, poweroff, etc.)
 	{
 		core->pc = core->pc + 4;
@@ -429,6 +743,50 @@ static uint32_t HandleControlLoad( uint32_t addy )
 	return 0;
 }
 
+// Host pointer to len bytes of guest RAM at guest address addy, or 0 if
+// they're not all RAM.
+static uint8_t * GuestRAM( uint32_t addy, uint32_t len )
+{
+	uint32_t ofs = addy - MINIRV32_RAM_IMAGE_OFFSET;
+	if( ofs > ram_amt || len > ram_amt - ofs )
+		return 0;
+	return ram_image + ofs;
+}
+
+// The host wrote len bytes at guest address addy.
+static void GuestRAMWritten( uint32_t addy, uint32_t len )
+{
+#ifdef MINIRV32_DECODE_CACHE
+	// Like a store, anything we decoded from there is stale now.
+	uint32_t ofs = addy - MINIRV32_RAM_IMAGE_OFFSET;
+	uint32_t p;
+	for( p = ofs & ~0xfff; len && p < ofs + len; p += 4096 )
+		MINIRV32_DECODE_CACHE_STORE( p );
+#endif
+}
+
+// Paravirtual memmove/memset: the guest writes the destination to 0x141, the
+// source (or fill byte) to 0x142, then the length to 0x143 to move or 0x144
+// to fill.  Reading 0x141 and 0x142 gives back what's there, so a csrr
+// doesn't clobber them.
+static uint32_t bulk_dst, bulk_src;
+
+static void HandleBulkMemory( uint32_t len, int fill )
+{
+	uint8_t * dst = GuestRAM( bulk_dst, len );
+	uint8_t * src = fill ? 0 : GuestRAM( bulk_src, len );
+	if( !dst || ( !fill && !src ) )
+	{
+		printf( "DEBUG PASSED INVALID BULK OP (%08x %08x %08x)\n", bulk_dst, bulk_src, len );
+		return;
+	}
+	if( fill )
+		memset( dst, bulk_src, len );
+	else
+		memmove( dst, src, len );
+	GuestRAMWritten( bulk_dst, len );
+}
+
 static void HandleOtherCSRWrite( uint8_t * image, uint16_t csrno, uint32_t value )
 {
 	if( csrno == 0x136 )
@@ -458,6 +816,12 @@ static void HandleOtherCSRWrite( uint8_t * image, uint16_t csrno, uint32_t value
 	{
 		putchar( value ); fflush( stdout );
 	}
+	else if( csrno == 0x141 )
+		bulk_dst = value;
+	else if( csrno == 0x142 )
+		bulk_src = value;
+	else if( csrno == 0x143 || csrno == 0x144 )
+		HandleBulkMemory( value, csrno == 0x144 );
 }
 
 static int32_t HandleOtherCSRRead( uint8_t * image, uint16_t csrno )
@@ -467,9 +831,229 @@ static int32_t HandleOtherCSRRead( uint8_t * image, uint16_t csrno )
 		if( !IsKBHit() ) return -1;
 		return ReadKBByte();
 	}
+	else if( csrno == 0x141 )
+		return bulk_dst;
+	else if( csrno == 0x142 )
+		return bulk_src;
 	return 0;
 }
 
+// High level emulation of hot kernel functions.  With -y, the entry points
+// of the functions below are looked up in an "objdump -t" symbol table, like
+// "make dumpkern" writes, and overwritten with a custom-0 instruction.  The
+// illegal instruction trap that makes runs the function on the host instead,
+// and returns to ra.  Each one returns how many bytes it went over, or -1 if
+// it wants to run in the guest after all.
+#define HLE_OPCODE 0x0b // custom-0, the entry's index goes in the top bits.
+#define HLE_MAX_ENTRIES 64
+
+static int HleMemmove( uint32_t * regs )
+{
+	uint8_t * dst = GuestRAM( regs[10], regs[12] );
+	uint8_t * src = GuestRAM( regs[11], regs[12] );
+	if( !dst || !src ) return -1;
+	memmove( dst, src, regs[12] );
+	GuestRAMWritten( regs[10], regs[12] );
+	return regs[12];
+}
+
+static int HleMemset( uint32_t * regs )
+{
+	uint8_t * dst = GuestRAM( regs[10], regs[12] );
+	if( !dst ) return -1;
+	memset( dst, regs[11], regs[12] );
+	GuestRAMWritten( regs[10], regs[12] );
+	return regs[12];
+}
+
+static int HleStrlen( uint32_t * regs )
+{
+	uint8_t * s = GuestRAM( regs[10], 0 );
+	uint8_t * end = s ? memchr( s, 0, ram_image + ram_amt - s ) : 0;
+	if( !end ) return -1;
+	regs[10] = end - s;
+	return regs[10] + 1;
+}
+
+// No MMU, so user copies can't fault: return 0 bytes left over.
+static int HleCopyUser( uint32_t * regs )
+{
+	int r = HleMemmove( regs );
+	if( r >= 0 ) regs[10] = 0;
+	return r;
+}
+
+static int HleClearUser( uint32_t * regs )
+{
+	uint8_t * dst = GuestRAM( regs[10], regs[11] );
+	if( !dst ) return -1;
+	memset( dst, 0, regs[11] );
+	GuestRAMWritten( regs[10], regs[11] );
+	regs[10] = 0;
+	return regs[11];
+}
+
+// csum_partial() from lib/checksum.c, step for step, so the folded result is
+// bit for bit what the guest would have got.
+static int HleCsumPartial( uint32_t * regs )
+{
+	int32_t len = regs[11];
+	uint8_t * buff = GuestRAM( regs[10], ( len > 0 ) ? len : 0 );
+	uint32_t addy = regs[10], sum = regs[12], result = 0;
+	int odd = addy & 1;
+	if( !buff ) return -1;
+	if( len > 0 )
+	{
+		if( odd ) { result += *buff << 8; len--; buff++; addy++; }
+		if( len >= 2 )
+		{
+			if( addy & 2 ) { result += buff[0] | ( buff[1] << 8 ); len -= 2; buff += 2; }
+			if( len >= 4 )
+			{
+				uint8_t * end = buff + ( len & ~3 );
+				uint32_t carry = 0;
+				do
+				{
+					uint32_t w = buff[0] | ( buff[1] << 8 ) | ( buff[2] << 16 ) | ( (uint32_t)buff[3] << 24 );
+					buff += 4;
+					result += carry;
+					result += w;
+					carry = ( w > result );
+				} while( buff < end );
+				result += carry;
+				result = ( result & 0xffff ) + ( result >> 16 );
+			}
+			if( len & 2 ) { result += buff[0] | ( buff[1] << 8 ); buff += 2; }
+		}
+		if( len & 1 )
+			result += *buff;
+		result = ( result & 0xffff ) + ( result >> 16 );
+		result = ( result & 0xffff ) + ( result >> 16 );
+		if( odd )
+			result = ( ( result >> 8 ) & 0xff ) | ( ( result & 0xff ) << 8 );
+	}
+	result += sum;
+	if( sum > result )
+		result += 1;
+	regs[10] = result;
+	return ( (int32_t)regs[11] > 0 ) ? regs[11] : 0;
+}
+
+static const struct HleFunction
+{
+	const char * name;
+	int (*fn)( uint32_t * regs );
+} hle_functions[] = {
+	{ "memcpy", HleMemmove }, { "__memcpy", HleMemmove },
+	{ "memmove", HleMemmove }, { "__memmove", HleMemmove },
+	{ "memset", HleMemset }, { "__memset", HleMemset },
+	{ "strlen", HleStrlen },
+	{ "__asm_copy_to_user", HleCopyUser }, { "__asm_copy_from_user", HleCopyUser },
+	{ "__clear_user", HleClearUser },
+	{ "csum_partial", HleCsumPartial },
+};
+
+static struct HleEntry
+{
+	uint32_t addy; // 0 once it's back to running in the guest.
+	uint32_t orig;
+	int func;
+	uint64_t calls, bytes;
+} hle_entries[HLE_MAX_ENTRIES];
+static int hle_count;
+
+static int LoadHleSymbols( const char * symfile )
+{
+	char line[1024];
+	FILE * f = fopen( symfile, "r" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: \"%s\" not found\n", symfile );
+		return -1;
+	}
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		// 80001234 g     F .text	00000064 memcpy
+		uint32_t addy, size;
+		char name[256];
+		char * tab = strchr( line, '\t' );
+		int i, j;
+		if( !tab || sscanf( line, "%x", &addy ) != 1 || sscanf( tab, "%x %255s", &size, name ) != 2 )
+			continue;
+		*tab = 0;
+		if( !strstr( line, " F " ) || !size )
+			continue;
+		for( i = 0; i < (int)( sizeof( hle_functions ) / sizeof( hle_functions[0] ) ); i++ )
+			if( strcmp( name, hle_functions[i].name ) == 0 )
+				break;
+		for( j = 0; j < hle_count; j++ )
+			if( hle_entries[j].addy == addy )
+				break; // Aliases, like memcpy and __memcpy.
+		if( i == sizeof( hle_functions ) / sizeof( hle_functions[0] ) || j < hle_count || hle_count == HLE_MAX_ENTRIES )
+			continue;
+		hle_entries[hle_count].addy = addy;
+		hle_entries[hle_count].func = i;
+		hle_count++;
+	}
+	fclose( f );
+	return 0;
+}
+
+// After the image is (re)loaded.
+static void PatchHleEntries( uint32_t imagelen )
+{
+	int i;
+	for( i = 0; i < hle_count; i++ )
+	{
+		uint32_t ofs = hle_entries[i].addy - MINIRV32_RAM_IMAGE_OFFSET;
+		if( !hle_entries[i].addy )
+			continue;
+		if( ofs >= imagelen - 3 || ( ofs & 1 ) )
+		{
+			fprintf( stderr, "Warning: %s at %08x isn't in the image\n", hle_functions[hle_entries[i].func].name, hle_entries[i].addy );
+			hle_entries[i].addy = 0;
+			continue;
+		}
+		hle_entries[i].orig = *(uint32_t*)( ram_image + ofs );
+		*(uint32_t*)( ram_image + ofs ) = HLE_OPCODE | ( i << 20 );
+	}
+}
+
+// Returns nonzero, and where to go next, if ir at pc was one of ours.
+static int HandleHle( uint32_t pc, uint32_t ir, uint32_t * nextpc )
+{
+	struct HleEntry * e;
+	int bytes;
+	if( ( ir & 0xfffff ) != HLE_OPCODE || (int)( ir >> 20 ) >= hle_count || hle_entries[ir >> 20].addy != pc )
+		return 0;
+	e = &hle_entries[ir >> 20];
+	bytes = hle_functions[e->func].fn( core->regs );
+	if( bytes < 0 )
+	{
+		// Put it back the way it was and run it there.
+		fprintf( stderr, "Warning: %s( %08x, %08x, %08x ) isn't all in RAM, running it in the guest from now on\n",
+			hle_functions[e->func].name, core->regs[10], core->regs[11], core->regs[12] );
+		*(uint32_t*)GuestRAM( pc, 4 ) = e->orig;
+		GuestRAMWritten( pc, 4 );
+		e->addy = 0;
+		*nextpc = pc;
+		return 1;
+	}
+	e->calls++;
+	e->bytes += bytes;
+	*nextpc = core->regs[1];
+	return 1;
+}
+
+static void DumpHleStats()
+{
+	int i;
+	for( i = 0; i < hle_count; i++ )
+		if( hle_entries[i].calls )
+			fprintf( stderr, "HLE %s: %llu calls, %llu bytes\n", hle_functions[hle_entries[i].func].name,
+				(unsigned long long)hle_entries[i].calls, (unsigned long long)hle_entries[i].bytes );
+}
+
 static int64_t SimpleReadNumberInt( const char * number, int64_t defaultNumber )
 {
 	if( !number || !number[0] ) return defaultNumber;
@@ -495,6 +1079,112 @@ static int64_t SimpleReadNumberInt( const char * number, int64_t defaultNumber )
 	}
 }
 
+// Just enough flattened device tree editing to adjust the built in DTB.
+static uint32_t FDTGet32( const uint8_t * p ) { return ( (uint32_t)p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3]; }
+static void FDTPut32( uint8_t * p, uint32_t v ) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+
+// Replace oldlen bytes at ofs with newlen bytes of room, moving the rest of
+// the blob and any blocks after it.  Block sizes are up to the caller.
+static int FDTSplice( uint8_t * dtb, int space, uint32_t ofs, uint32_t oldlen, uint32_t newlen )
+{
+	uint32_t total = FDTGet32( dtb + 4 );
+	int i;
+	if( total - oldlen + newlen > (uint32_t)space )
+		return -1;
+	memmove( dtb + ofs + newlen, dtb + ofs + oldlen, total - ofs - oldlen );
+	FDTPut32( dtb + 4, total - oldlen + newlen );
+	for( i = 8; i <= 16; i += 4 ) // off_dt_struct, off_dt_strings, off_mem_rsvmap
+		if( FDTGet32( dtb + i ) >= ofs + oldlen )
+			FDTPut32( dtb + i, FDTGet32( dtb + i ) - oldlen + newlen );
+	return 0;
+}
+
+// Offset of the first token inside the node at path, like "/cpus/cpu@0", or 0.
+static uint32_t FDTFindNode( const uint8_t * dtb, const char * path )
+{
+	uint32_t p = FDTGet32( dtb + 8 );
+	uint32_t end = p + FDTGet32( dtb + 36 );
+	int depth = 0, matched = 0;
+	while( p < end )
+	{
+		uint32_t tok = FDTGet32( dtb + p );
+		p += 4;
+		if( tok == 1 ) // FDT_BEGIN_NODE
+		{
+			const char * name = (const char *)dtb + p;
+			int namelen = strlen( name );
+			p += ( namelen + 4 ) & ~3;
+			if( depth++ != matched )
+				continue;
+			if( depth == 1 ) // The root, which has no name.
+				path += ( *path == '/' );
+			else if( namelen == (int)strcspn( path, "/" ) && strncmp( name, path, namelen ) == 0 )
+				path += namelen + ( path[namelen] == '/' );
+			else
+				continue;
+			matched++;
+			if( !*path )
+				return p;
+		}
+		else if( tok == 2 ) // FDT_END_NODE
+		{
+			if( --depth < matched )
+				return 0;
+		}
+		else if( tok == 3 ) // FDT_PROP
+			p += 8 + ( ( FDTGet32( dtb + p ) + 3 ) & ~3 );
+		else if( tok != 4 ) // FDT_NOP
+			break;
+	}
+	return 0;
+}
+
+// Set, or add, a property.  dtb has room for space bytes.  Returns the new
+// size of the blob, or -1 if the node isn't there or it doesn't fit.
+static int FDTSetProp( uint8_t * dtb, int space, const char * path, const char * name, const void * val, int len )
+{
+	uint32_t p = FDTFindNode( dtb, path );
+	uint32_t strofs = FDTGet32( dtb + 12 );
+	uint32_t strsize = FDTGet32( dtb + 32 );
+	uint32_t newlen = 12 + ( ( len + 3 ) & ~3 );
+	uint32_t oldlen = 0, nameofs, tok;
+	if( !p )
+		return -1;
+
+	// Properties come before subnodes.
+	while( ( tok = FDTGet32( dtb + p ) ) == 3 || tok == 4 )
+	{
+		if( tok == 3 && strcmp( (const char *)dtb + strofs + FDTGet32( dtb + p + 8 ), name ) == 0 )
+			break;
+		p += ( tok == 3 ) ? 12 + ( ( FDTGet32( dtb + p + 4 ) + 3 ) & ~3 ) : 4;
+	}
+
+	if( tok == 3 )
+	{
+		nameofs = FDTGet32( dtb + p + 8 );
+		oldlen = 12 + ( ( FDTGet32( dtb + p + 4 ) + 3 ) & ~3 );
+	}
+	else
+	{
+		// New name, add it to the end of the strings block.
+		nameofs = strsize;
+		if( FDTSplice( dtb, space, strofs + strsize, 0, strlen( name ) + 1 ) )
+			return -1;
+		memcpy( dtb + strofs + strsize, name, strlen( name ) + 1 );
+		FDTPut32( dtb + 32, strsize + strlen( name ) + 1 );
+	}
+
+	if( FDTSplice( dtb, space, p, oldlen, newlen ) )
+		return -1;
+	FDTPut32( dtb + p, 3 );
+	FDTPut32( dtb + p + 4, len );
+	FDTPut32( dtb + p + 8, nameofs );
+	memset( dtb + p + 12, 0, newlen - 12 );
+	memcpy( dtb + p + 12, val, len );
+	FDTPut32( dtb + 36, FDTGet32( dtb + 36 ) - oldlen + newlen );
+	return FDTGet32( dtb + 4 );
+}
+
 static void DumpState( struct MiniRV32IMAState * core, uint8_t * ram_image )
 {
 	uint32_t pc = core->pc;
@@ -518,3 +1208,15 @@ static void DumpState( struct MiniRV32IMAState * core, uint8_t * ram_image )
 		regs[24], regs[25], regs[26], regs[27], regs[28], regs[29], regs[30], regs[31] );
 }
 
+
+#ifdef MINIRV32_FUSION
+static void DumpFusionStats()
+{
+	static const char * const names[MINIRV32_FUSION_COUNT] = MINIRV32_FUSION_NAMES;
+	int i;
+	fprintf( stderr, "Fused pairs:" );
+	for( i = 0; i < MINIRV32_FUSION_COUNT; i++ )
+		fprintf( stderr, " %s:%llu", names[i], (unsigned long long)MINIRV32_DECODE_CACHE_PTR->fused[i] );
+	fprintf( stderr, "\n" );
+}
+#endif
@@ -57,6 +57,11 @@
 	#define MINIRV32_OTHERCSR_READ(...);
 #endif
 
+// For use inside the hooks above: finish the current instruction and return
+// from MiniRV32IMAStep(), so the host sees what a device just did (a new timer
+// deadline, an interrupt to deliver) without waiting for the quantum to end.
+#define MINIRV32_END_QUANTUM() ( count = 0 )
+
 #ifndef MINIRV32_CUSTOM_MEMORY_BUS
 	#define MINIRV32_STORE4( ofs, val ) *(uint32_t*)(image + ofs) = val
 	#define MINIRV32_STORE2( ofs, val ) *(uint16_t*)(image + ofs) = val
@@ -100,12 +105,243 @@ struct MiniRV32IMAState
 	// Bit 2 = WFI (Wait for interrupt)
 	// Bit 3+ = Load/Store reservation LSBs.
 	uint32_t extraflags;
+
+#ifdef MINIRV32_FPU
+	uint32_t fcsr; // fflags in bits 0..4, frm in 5..7.
+	uint64_t fregs[32]; // Singles are NaN-boxed, upper 32 bits all set.
+#endif
 };
 
 #ifndef MINIRV32_STEPPROTO
 MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count );
 #endif
 
+#ifdef MINIRV32_FAST_FORWARD
+// Optional, call between steps when MiniRV32IMAStep() returned 0.  Looks for
+// a short loop around the PC that only computes in registers and reads
+// memory or MMIO, like a UART poll or a delay loop.  Counted loops are
+// skipped ahead by up to maxskip instructions.  Returns what a step would,
+// and 1 (like WFI, but without setting the WFI flag) if the loop came back
+// around to exactly the same registers, so only an interrupt or an MMIO
+// register changing can get the guest out of it.
+MINIRV32_DECORATE int32_t MiniRV32IMAFastForward( struct MiniRV32IMAState * state, uint8_t * image, uint32_t maxskip );
+#endif
+
+// The JIT emits x86-64 SysV code that works directly on the state struct
+// and RAM, so it can't be used with custom internals or memory busses.
+#if defined( MINIRV32_JIT ) && ( !defined( __x86_64__ ) || defined( _WIN32 ) || defined( MINIRV32_CUSTOM_INTERNALS ) || defined( MINIRV32_CUSTOM_MEMORY_BUS ) )
+	#undef MINIRV32_JIT
+#endif
+
+#if defined( MINIRV32_JIT ) && !defined( MINIRV32_BLOCK_CACHE )
+	#define MINIRV32_BLOCK_CACHE // The JIT translates blocks.
+#endif
+
+// Translated blocks already run straight through both halves of a pair.
+#if defined( MINIRV32_FUSION ) && defined( MINIRV32_JIT )
+	#undef MINIRV32_FUSION
+#endif
+
+#if defined( MINIRV32_FUSION ) && !defined( MINIRV32_DECODE_CACHE )
+	#define MINIRV32_DECODE_CACHE // Pairs are fused when they are decoded.
+#endif
+
+#if defined( MINIRV32_BLOCK_CACHE ) && !defined( MINIRV32_DECODE_CACHE )
+	#define MINIRV32_DECODE_CACHE // Blocks are made of decoded instructions.
+#endif
+
+// The decode cache, blocks, fusion and the JIT all step the PC by 4.
+#if defined( MINIRV32_RVC ) && defined( MINIRV32_DECODE_CACHE )
+	#error MINIRV32_RVC only works with the plain interpreter.
+#endif
+
+#ifdef MINIRV32_RVC
+	#define MINIRV32_MISA_C 0x4
+	#define MINIRV32_ISA_C "c"
+#else
+	#define MINIRV32_MISA_C 0
+	#define MINIRV32_ISA_C ""
+#endif
+
+#ifdef MINIRV32_FPU
+	#define MINIRV32_MISA_FD 0x28
+	#define MINIRV32_ISA_FD "fd"
+	#define MINIRV32_MSTATUS_KEEP 0x6000 // FS, traps and mret leave it alone.
+#else
+	#define MINIRV32_MISA_FD 0
+	#define MINIRV32_ISA_FD ""
+	#define MINIRV32_MSTATUS_KEEP 0
+#endif
+
+#ifdef MINIRV32_ZB
+	#define MINIRV32_MISA_B 0x2 // B is Zba + Zbb + Zbs.
+	#define MINIRV32_ISA_ZB "_zba_zbb_zbs"
+#else
+	#define MINIRV32_MISA_B 0
+	#define MINIRV32_ISA_ZB ""
+#endif
+
+// What to put in the device tree's riscv,isa.
+#define MINIRV32_ISA_STRING "rv32ima" MINIRV32_ISA_FD MINIRV32_ISA_C MINIRV32_ISA_ZB
+
+#ifdef MINIRV32_GUARD_PAGES
+
+// Optional, for hosts with signals and virtual memory.  image is the start of
+// a MINIRV32_GUARD_RESERVE byte host mapping, RAM first and the rest
+// PROT_NONE, so image + ( address - MINIRV32_RAM_IMAGE_OFFSET ), wrapped to
+// 32 bits, lands in it for any guest address.  Loads and stores then go
+// straight to the host, and the ones that aren't RAM (MMIO, or nothing)
+// fault.  The host's SIGSEGV handler siglongjmp()s to
+// MINIRV32_GUARD_PTR->jmp, and the step does that instruction, and the rest
+// of its quantum, again with the usual checks.
+
+#if defined( MINIRV32_CUSTOM_MEMORY_BUS )
+	#error MINIRV32_GUARD_PAGES needs image to be plain host memory.
+#endif
+
+#include <setjmp.h>
+
+#define MINIRV32_GUARD_RESERVE ( ( 1ull << 32 ) + 4096 ) // The extra page catches accesses that straddle the end.
+
+struct MiniRV32IMAGuard
+{
+	sigjmp_buf jmp; // Set on the way into each step, don't save the signal mask.
+	uint32_t pc, cycle; // The last access that went unchecked.
+};
+
+#endif
+
+#ifdef MINIRV32_DECODE_CACHE
+
+// Optional predecoded instruction cache.  Define MINIRV32_DECODE_CACHE to
+// enable it.  Instructions are split into operands, have their immediates
+// sign-extended and get a handler index the first time a PC is executed.
+// Any RAM store to a 4kB page that has been decoded from invalidates the
+// cached entries for that page, so self-modifying code still works.
+
+#ifndef MINIRV32_DECODE_CACHE_BITS
+	#define MINIRV32_DECODE_CACHE_BITS 14 // 16k entries, 256kB.  Must be <= 22.
+#endif
+
+#ifndef MINIRV32_DECODE_CACHE_PAGE_SLOTS
+	#define MINIRV32_DECODE_CACHE_PAGE_SLOTS 4096 // Power of 2, pages alias into these.
+#endif
+
+enum MiniRV32IMADecodedOp
+{
+	MINIRV32_DOP_SLOW = 0, // CSR, SYSTEM, AMO, FENCE, or anything odd.  Run the full decoder.
+	MINIRV32_DOP_LI,       // LUI / AUIPC, imm is the result.
+	MINIRV32_DOP_JAL,      // imm is target - 4.
+	MINIRV32_DOP_JALR,
+	MINIRV32_DOP_BEQ, MINIRV32_DOP_BNE, MINIRV32_DOP_BLT, MINIRV32_DOP_BGE, MINIRV32_DOP_BLTU, MINIRV32_DOP_BGEU, // imm is target - 4.
+	MINIRV32_DOP_LB, MINIRV32_DOP_LH, MINIRV32_DOP_LW, MINIRV32_DOP_LBU, MINIRV32_DOP_LHU,
+	MINIRV32_DOP_SB, MINIRV32_DOP_SH, MINIRV32_DOP_SW,
+	MINIRV32_DOP_ADDI, MINIRV32_DOP_SLTI, MINIRV32_DOP_SLTIU, MINIRV32_DOP_XORI, MINIRV32_DOP_ORI, MINIRV32_DOP_ANDI,
+	MINIRV32_DOP_SLLI, MINIRV32_DOP_SRLI, MINIRV32_DOP_SRAI,
+	MINIRV32_DOP_ADD, MINIRV32_DOP_SUB, MINIRV32_DOP_SLL, MINIRV32_DOP_SLT, MINIRV32_DOP_SLTU,
+	MINIRV32_DOP_XOR, MINIRV32_DOP_SRL, MINIRV32_DOP_SRA, MINIRV32_DOP_OR, MINIRV32_DOP_AND,
+	MINIRV32_DOP_MUL, MINIRV32_DOP_MULH, MINIRV32_DOP_MULHSU, MINIRV32_DOP_MULHU,
+	MINIRV32_DOP_DIV, MINIRV32_DOP_DIVU, MINIRV32_DOP_REM, MINIRV32_DOP_REMU,
+#ifdef MINIRV32_ZB
+	MINIRV32_DOP_BITMANIP, // Anything MiniRV32IMABitmanip() does.
+#endif
+#ifdef MINIRV32_FUSION
+	// Two instructions run as one, see MiniRV32IMAFuse().  Jumps and branches
+	// must stay last, MINIRV32_DOP_ENDS_BLOCK relies on it.
+	MINIRV32_DOP_FUSE_LUI_ADDI, MINIRV32_DOP_FUSE_AUIPC_ADDI, MINIRV32_DOP_FUSE_SLLI_SRLI,
+	MINIRV32_DOP_FUSE_AUIPC_JALR,
+	MINIRV32_DOP_FUSE_SLT_BR, MINIRV32_DOP_FUSE_SLTU_BR, MINIRV32_DOP_FUSE_SLTI_BR, MINIRV32_DOP_FUSE_SLTIU_BR,
+#endif
+};
+
+#ifdef MINIRV32_FUSION
+// How many times each fused op ran, in MiniRV32IMADecodeCache::fused.
+#define MINIRV32_FUSION_COUNT 8
+#define MINIRV32_FUSION_NAMES { "lui+addi", "auipc+addi", "slli+srli", "auipc+jalr", "slt+bxxz", "sltu+bxxz", "slti+bxxz", "sltiu+bxxz" }
+#endif
+
+struct MiniRV32IMADecoded
+{
+	uint32_t pc;  // Guest PC this was decoded from.  1 = invalid.
+	uint32_t ir;
+	int32_t imm;
+	uint8_t op;   // enum MiniRV32IMADecodedOp
+	uint8_t rd;   // 0 if the instruction does not write back.
+	uint8_t rs1;
+	uint8_t rs2;
+#ifdef MINIRV32_FUSION
+	// Fused pairs only.  rd2 is the rd of the second instruction, except for
+	// compare and branch, where it's the compare result that doesn't branch.
+	// imm2 is the second result, or the branch target - 4.
+	uint8_t rd2;
+	int32_t imm2;
+#endif
+};
+
+#ifdef MINIRV32_BLOCK_CACHE
+
+// Optional basic block cache, define MINIRV32_BLOCK_CACHE to use it instead
+// of the per-instruction table above.  A block runs from its first
+// instruction up to and including the first jump, branch or anything that
+// needs the full decoder.  Blocks remember where they went last time, so
+// most of the time moving to the next block is just a tag compare.  Blocks
+// never cross a 4kB page, so invalidation works the same as above.
+
+#ifndef MINIRV32_BLOCK_CACHE_BITS
+	#define MINIRV32_BLOCK_CACHE_BITS 13 // 8k blocks.  Must be <= 22.
+#endif
+
+#ifndef MINIRV32_BLOCK_MAX_OPS
+	#define MINIRV32_BLOCK_MAX_OPS 16
+#endif
+
+#ifndef MINIRV32_BLOCK_RAS_SIZE
+	#define MINIRV32_BLOCK_RAS_SIZE 16 // Power of 2.
+#endif
+
+struct MiniRV32IMABlock
+{
+	// ops[len] is always left invalid, so running off the end of a block
+	// looks the same as branching away from it.
+	struct MiniRV32IMADecoded ops[MINIRV32_BLOCK_MAX_OPS+1];
+	struct MiniRV32IMABlock * next[2]; // Where we fell through to / jumped to last time.
+	uint32_t endpc; // pc just past the last instruction.
+	uint16_t len;
+	uint16_t exitkind; // 0 = plain, 1 = call, 2 = return.
+#ifdef MINIRV32_JIT
+	uint32_t hits;
+	void * native; // Translated host code, see mini-rv32ima-jit.h
+#endif
+};
+
+#endif
+
+// NOTE: If you are relocating RAM to 0 with MINIRV32_RAM_IMAGE_OFFSET, be
+// sure to call MiniRV32IMAFlushDecodeCache() once before the first step.
+struct MiniRV32IMADecodeCache
+{
+#ifdef MINIRV32_BLOCK_CACHE
+	struct MiniRV32IMABlock blocks[1<<MINIRV32_BLOCK_CACHE_BITS];
+	struct MiniRV32IMABlock * ras[MINIRV32_BLOCK_RAS_SIZE]; // Return address predictor, for JALR.
+	uint32_t rastop;
+#ifdef MINIRV32_JIT
+	uint8_t * jitarena;
+	uint32_t jitused;
+#endif
+#else
+	struct MiniRV32IMADecoded entries[1<<MINIRV32_DECODE_CACHE_BITS];
+#endif
+	uint8_t codepages[MINIRV32_DECODE_CACHE_PAGE_SLOTS];
+#ifdef MINIRV32_FUSION
+	uint64_t fused[MINIRV32_FUSION_COUNT];
+#endif
+};
+
+MINIRV32_DECORATE void MiniRV32IMAFlushDecodeCache( struct MiniRV32IMADecodeCache * cache );
+MINIRV32_DECORATE void MiniRV32IMAInvalidateDecodePage( struct MiniRV32IMADecodeCache * cache, uint32_t ofs );
+
+#endif
+
 #ifdef MINIRV32_IMPLEMENTATION
 
 #ifndef MINIRV32_CUSTOM_INTERNALS
@@ -113,6 +349,859 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 #define SETCSR( x, val ) { state->x = val; }
 #define REG( x ) state->regs[x]
 #define REGSET( x, val ) { state->regs[x] = val; }
+#ifdef MINIRV32_FPU
+#define FREG( x ) state->fregs[x]
+#define FREGSET( x, val ) { state->fregs[x] = val; }
+#endif
+#endif
+
+// Instruction dispatch.  Define MINIRV32_DISPATCH=GOTO to decode through
+// tables of label addresses (GCC/Clang, C only) instead of switch statements.
+// Either way, the instructions themselves are the same code.
+#define MINIRV32_DISPATCH_IS_GOTO 1
+#define MINIRV32_DISPATCH_CAT2( a, b ) a##b
+#define MINIRV32_DISPATCH_CAT( a, b ) MINIRV32_DISPATCH_CAT2( a, b )
+
+#if defined( MINIRV32_DISPATCH ) && MINIRV32_DISPATCH_CAT( MINIRV32_DISPATCH_IS_, MINIRV32_DISPATCH ) && \
+	defined( __GNUC__ ) && !defined( __cplusplus ) && !defined( __TINYC__ ) && !defined( CUSTOM_MULH )
+	#define MINIRV32_DISPATCH_GOTO
+#endif
+
+#ifdef MINIRV32_DISPATCH_GOTO
+	// break still needs something to break out of, so jump into the body of
+	// a loop that never runs again.  Only the opcode goes through a table, the
+	// funct3 switches are already jump tables and GCC makes worse code when it
+	// has to assume every computed goto can land on every label.
+	#define MINIRV32_SWITCH( tbl, x ) for( ({ goto *minirv32_##tbl##_tbl[x]; }); 0; )
+	#define MINIRV32_CASE( tbl, n ) minirv32_##tbl##_##n
+	#define MINIRV32_DEFAULT( tbl ) minirv32_##tbl##_default
+	#define MINIRV32_LABEL( tbl, n ) &&minirv32_##tbl##_##n
+#else
+	#define MINIRV32_SWITCH( tbl, x ) switch( x )
+	#define MINIRV32_CASE( tbl, n ) case n
+	#define MINIRV32_DEFAULT( tbl ) default
+#endif
+
+#ifdef MINIRV32_ZB
+
+#if defined( __GNUC__ ) && !defined( __TINYC__ )
+	#define MINIRV32_CLZ( x ) ( (x) ? __builtin_clz( x ) : 32 )
+	#define MINIRV32_CTZ( x ) ( (x) ? __builtin_ctz( x ) : 32 )
+	#define MINIRV32_CPOP( x ) __builtin_popcount( x )
+	#define MINIRV32_REV8( x ) __builtin_bswap32( x )
+#else
+static uint32_t MiniRV32IMAClz( uint32_t x ) { uint32_t n = 0; while( n < 32 && !( x & 0x80000000 ) ) { x <<= 1; n++; } return n; }
+static uint32_t MiniRV32IMACtz( uint32_t x ) { uint32_t n = 0; while( n < 32 && !( x & 1 ) ) { x >>= 1; n++; } return n; }
+static uint32_t MiniRV32IMACpop( uint32_t x ) { uint32_t n = 0; for( ; x; x &= x - 1 ) n++; return n; }
+	#define MINIRV32_CLZ( x ) MiniRV32IMAClz( x )
+	#define MINIRV32_CTZ( x ) MiniRV32IMACtz( x )
+	#define MINIRV32_CPOP( x ) MiniRV32IMACpop( x )
+	#define MINIRV32_REV8( x ) ( ( (x) >> 24 ) | ( ( (x) >> 8 ) & 0xff00 ) | ( ( (x) << 8 ) & 0xff0000 ) | ( (x) << 24 ) )
+#endif
+// Compilers turn these into a single rotate.
+#define MINIRV32_ROR( x, n ) ( ( (x) >> ( (n) & 31 ) ) | ( (x) << ( ( 32 - (n) ) & 31 ) ) )
+#define MINIRV32_ROL( x, n ) ( ( (x) << ( (n) & 31 ) ) | ( (x) >> ( ( 32 - (n) ) & 31 ) ) )
+
+// Zba, Zbb and Zbs.  ir is an OP or OP-IMM instruction, and rs2 is either the
+// register or the sign-extended immediate.  Returns 0, without touching rval,
+// if ir is not one of these, so the base ISA and M can have it.
+static int MiniRV32IMABitmanip( uint32_t ir, uint32_t rs1, uint32_t rs2, uint32_t * rval )
+{
+	uint32_t funct3 = ( ir >> 12 ) & 7;
+	uint32_t sh = rs2 & 0x1f;
+
+	// The base ISA and M only use funct7 0x00, 0x01 and 0x20, and of those
+	// Zbb only has andn, orn and xnor.  Let everything else through quickly.
+	if( !( ir & 0xbc000000 ) && ( ir & 0x40004020 ) != 0x40004020 )
+		return 0;
+
+	if( ir & 0x20 ) // OP
+	{
+		switch( ( ( ir >> 25 ) << 3 ) | funct3 ) // funct7, funct3
+		{
+			case 0x82: *rval = ( rs1 << 1 ) + rs2; return 1; // SH1ADD
+			case 0x84: *rval = ( rs1 << 2 ) + rs2; return 1; // SH2ADD
+			case 0x86: *rval = ( rs1 << 3 ) + rs2; return 1; // SH3ADD
+			case 0x104: *rval = rs1 ^ ~rs2; return 1; // XNOR
+			case 0x106: *rval = rs1 | ~rs2; return 1; // ORN
+			case 0x107: *rval = rs1 & ~rs2; return 1; // ANDN
+			case 0x2c: *rval = ( (int32_t)rs1 < (int32_t)rs2 ) ? rs1 : rs2; return 1; // MIN
+			case 0x2d: *rval = ( rs1 < rs2 ) ? rs1 : rs2; return 1; // MINU
+			case 0x2e: *rval = ( (int32_t)rs1 > (int32_t)rs2 ) ? rs1 : rs2; return 1; // MAX
+			case 0x2f: *rval = ( rs1 > rs2 ) ? rs1 : rs2; return 1; // MAXU
+			case 0x181: *rval = MINIRV32_ROL( rs1, sh ); return 1; // ROL
+			case 0x185: *rval = MINIRV32_ROR( rs1, sh ); return 1; // ROR
+			case 0x24: if( ( ir >> 20 ) & 0x1f ) return 0; *rval = rs1 & 0xffff; return 1; // ZEXT.H
+			case 0x121: *rval = rs1 & ~( 1u << sh ); return 1; // BCLR
+			case 0x125: *rval = ( rs1 >> sh ) & 1; return 1; // BEXT
+			case 0x1a1: *rval = rs1 ^ ( 1u << sh ); return 1; // BINV
+			case 0xa1: *rval = rs1 | ( 1u << sh ); return 1; // BSET
+		}
+		return 0;
+	}
+
+	// OP-IMM, where only the shifts have room for these.
+	switch( ( ( ir >> 25 ) << 3 ) | funct3 )
+	{
+		case 0x181:
+			switch( sh )
+			{
+				case 0: *rval = MINIRV32_CLZ( rs1 ); return 1; // CLZ
+				case 1: *rval = MINIRV32_CTZ( rs1 ); return 1; // CTZ
+				case 2: *rval = MINIRV32_CPOP( rs1 ); return 1; // CPOP
+				case 4: *rval = (int32_t)(int8_t)rs1; return 1; // SEXT.B
+				case 5: *rval = (int32_t)(int16_t)rs1; return 1; // SEXT.H
+			}
+			return 0;
+		case 0x185: *rval = MINIRV32_ROR( rs1, sh ); return 1; // RORI
+		case 0xa5: // ORC.B
+			if( sh != 7 ) return 0;
+			*rval = ( ( ( ( rs1 & 0x7f7f7f7f ) + 0x7f7f7f7f ) | rs1 ) & 0x80808080 ) / 0x80 * 0xff;
+			return 1;
+		case 0x1a5: // REV8
+			if( sh != 24 ) return 0;
+			*rval = MINIRV32_REV8( rs1 );
+			return 1;
+		case 0x121: *rval = rs1 & ~( 1u << sh ); return 1; // BCLRI
+		case 0x125: *rval = ( rs1 >> sh ) & 1; return 1; // BEXTI
+		case 0x1a1: *rval = rs1 ^ ( 1u << sh ); return 1; // BINVI
+		case 0xa1: *rval = rs1 | ( 1u << sh ); return 1; // BSETI
+	}
+	return 0;
+}
+
+#endif
+
+#ifdef MINIRV32_FPU
+
+// F and D on the host's float and double.  RISC-V wants a canonical NaN out
+// of anything that makes a NaN, and its own saturating float to int
+// conversions, the rest is just IEEE 754.  Exception flags are picked up from
+// the host after each instruction, they are cleared on the way into Step().
+
+#include <math.h>
+#include <fenv.h>
+
+#define MINIRV32_FNAN32 0x7fc00000
+#define MINIRV32_FNAN64 0x7ff8000000000000ull
+#define MINIRV32_FBOX( v ) ( 0xffffffff00000000ull | (uint32_t)(v) )
+#define MINIRV32_FUNBOX( v ) ( ( (v) >> 32 ) == 0xffffffff ? (uint32_t)(v) : MINIRV32_FNAN32 )
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __SSE2_MATH__ ) )
+#include <xmmintrin.h>
+// SSE keeps its flags in MXCSR, reading that is a lot cheaper than fetestexcept().
+static inline uint32_t MiniRV32IMAHostFlags()
+{
+	uint32_t m = _mm_getcsr();
+	return ( ( m & 0x20 ) >> 5 ) | ( ( m & 0x10 ) >> 3 ) | ( ( m & 0x08 ) >> 1 ) | ( ( m & 0x04 ) << 1 ) | ( ( m & 0x01 ) << 4 );
+}
+#define MINIRV32_FPU_CLEARFLAGS() _mm_setcsr( _mm_getcsr() & ~0x3f )
+#else
+static inline uint32_t MiniRV32IMAHostFlags()
+{
+	int e = fetestexcept( FE_ALL_EXCEPT );
+	return ( ( e & FE_INEXACT ) ? 1 : 0 ) | ( ( e & FE_UNDERFLOW ) ? 2 : 0 ) | ( ( e & FE_OVERFLOW ) ? 4 : 0 ) |
+		( ( e & FE_DIVBYZERO ) ? 8 : 0 ) | ( ( e & FE_INVALID ) ? 16 : 0 );
+}
+#define MINIRV32_FPU_CLEARFLAGS() feclearexcept( FE_ALL_EXCEPT )
+#endif
+
+static inline float MiniRV32IMAToF( uint32_t v ) { union { uint32_t i; float f; } u; u.i = v; return u.f; }
+static inline double MiniRV32IMAToD( uint64_t v ) { union { uint64_t i; double d; } u; u.i = v; return u.d; }
+static inline uint32_t MiniRV32IMAFromF( float f ) { union { uint32_t i; float f; } u; u.f = f; return u.i; }
+static inline uint64_t MiniRV32IMAFromD( double d ) { union { uint64_t i; double d; } u; u.d = d; return u.i; }
+
+// The operations that round.  op is funct5 of OP-FP, except 0x1b is
+// fcvt.fmt.wu and 0x20..0x23 are fmadd, fmsub, fnmsub and fnmadd.
+static uint64_t MiniRV32IMAFpuCalc( uint32_t op, uint32_t dbl, uint64_t a, uint64_t b, uint64_t c, uint32_t x )
+{
+	if( dbl )
+	{
+		double fa = MiniRV32IMAToD( a ), fb = MiniRV32IMAToD( b ), fc = MiniRV32IMAToD( c ), r;
+		switch( op )
+		{
+			case 0x00: r = fa + fb; break;
+			case 0x01: r = fa - fb; break;
+			case 0x02: r = fa * fb; break;
+			case 0x03: r = fa / fb; break;
+			case 0x08: r = MiniRV32IMAToF( MINIRV32_FUNBOX( a ) ); break; // FCVT.D.S
+			case 0x0b: r = sqrt( fa ); break;
+			case 0x1a: r = (int32_t)x; break;
+			case 0x1b: r = x; break;
+			case 0x20: r = fma( fa, fb, fc ); break;
+			case 0x21: r = fma( fa, fb, -fc ); break;
+			case 0x22: r = fma( -fa, fb, fc ); break;
+			default: r = fma( -fa, fb, -fc ); break;
+		}
+		return ( r != r ) ? MINIRV32_FNAN64 : MiniRV32IMAFromD( r );
+	}
+	else
+	{
+		float fa = MiniRV32IMAToF( MINIRV32_FUNBOX( a ) ), fb = MiniRV32IMAToF( MINIRV32_FUNBOX( b ) ), fc = MiniRV32IMAToF( MINIRV32_FUNBOX( c ) ), r;
+		switch( op )
+		{
+			case 0x00: r = fa + fb; break;
+			case 0x01: r = fa - fb; break;
+			case 0x02: r = fa * fb; break;
+			case 0x03: r = fa / fb; break;
+			case 0x08: r = (float)MiniRV32IMAToD( a ); break; // FCVT.S.D
+			case 0x0b: r = sqrtf( fa ); break;
+			case 0x1a: r = (float)(int32_t)x; break;
+			case 0x1b: r = (float)x; break;
+			case 0x20: r = fmaf( fa, fb, fc ); break;
+			case 0x21: r = fmaf( fa, fb, -fc ); break;
+			case 0x22: r = fmaf( -fa, fb, fc ); break;
+			default: r = fmaf( -fa, fb, -fc ); break;
+		}
+		return MINIRV32_FBOX( ( r != r ) ? MINIRV32_FNAN32 : MiniRV32IMAFromF( r ) );
+	}
+}
+
+// FCVT.W[U].fmt, rm is already resolved.
+static uint32_t MiniRV32IMAFpuToInt( double v, uint32_t rm, uint32_t isunsigned, uint32_t * fcsr )
+{
+	double r;
+	if( v != v )
+	{
+		*fcsr |= 0x10;
+		return isunsigned ? 0xffffffff : 0x7fffffff;
+	}
+	switch( rm )
+	{
+		case 0: r = nearbyint( v ); break; // The host is always round to nearest, out here.
+		case 1: r = trunc( v ); break;
+		case 2: r = floor( v ); break;
+		case 3: r = ceil( v ); break;
+		default: r = round( v ); break;
+	}
+	if( isunsigned ? ( r < 0 || r > 4294967295.0 ) : ( r < -2147483648.0 || r > 2147483647.0 ) )
+	{
+		*fcsr |= 0x10;
+		if( isunsigned ) return ( r < 0 ) ? 0 : 0xffffffff;
+		return ( r < 0 ) ? 0x80000000 : 0x7fffffff;
+	}
+	if( r != v )
+		*fcsr |= 1;
+	return isunsigned ? (uint32_t)r : (uint32_t)(int32_t)r;
+}
+
+// FCLASS, for either format.
+static uint32_t MiniRV32IMAFpuClass( uint64_t v, uint32_t dbl )
+{
+	uint32_t mbits = dbl ? 52 : 23;
+	uint32_t sign = dbl ? ( v >> 63 ) : ( ( v >> 31 ) & 1 );
+	uint32_t exp = ( v >> mbits ) & ( dbl ? 0x7ff : 0xff );
+	uint64_t mant = v & ( ( 1ull << mbits ) - 1 );
+	uint32_t expmax = dbl ? 0x7ff : 0xff;
+	if( exp == expmax )
+	{
+		if( !mant ) return sign ? 1 : 0x80; // -inf, +inf
+		return ( mant >> ( mbits - 1 ) ) ? 0x200 : 0x100; // Quiet, signaling NaN.
+	}
+	if( exp == 0 )
+	{
+		if( !mant ) return sign ? 0x8 : 0x10; // -0, +0
+		return sign ? 0x4 : 0x20; // Subnormal.
+	}
+	return sign ? 0x2 : 0x40;
+}
+
+// OP-FP and the fused multiply-adds.  a, b and c are the rs1, rs2 and rs3 FP
+// registers, x is the integer rs1.  Returns -1 for an illegal instruction, 0
+// if *result goes to the FP rd, or 1 if it goes to the integer rd.
+static int MiniRV32IMAFpuOp( uint32_t ir, uint64_t a, uint64_t b, uint64_t c, uint32_t x, uint32_t * fcsr, uint64_t * result )
+{
+	uint32_t funct5 = ir >> 27;
+	uint32_t dbl = ( ir >> 25 ) & 3;
+	uint32_t rm = ( ir >> 12 ) & 7;
+	uint32_t rs2 = ( ir >> 20 ) & 0x1f;
+	uint32_t op = funct5;
+
+	if( dbl > 1 )
+		return -1; // Half and quad.
+
+	if( ( ir & 0x7f ) != 0x53 )
+	{
+		// The fused multiply-adds, rs3 is where funct5 would be.  inf * 0 is
+		// invalid even with a quiet NaN to add, where the host says nothing.
+		uint32_t ca = MiniRV32IMAFpuClass( dbl ? a : MINIRV32_FUNBOX( a ), dbl );
+		uint32_t cb = MiniRV32IMAFpuClass( dbl ? b : MINIRV32_FUNBOX( b ), dbl );
+		if( ( ( ca & 0x81 ) && ( cb & 0x18 ) ) || ( ( ca & 0x18 ) && ( cb & 0x81 ) ) )
+			*fcsr |= 0x10;
+		op = 0x20 | ( ( ir >> 2 ) & 3 );
+	}
+	else switch( funct5 )
+	{
+		case 0x00: case 0x01: case 0x02: case 0x03: // FADD, FSUB, FMUL, FDIV
+			break;
+		case 0x0b: case 0x08: // FSQRT, FCVT.S.D / FCVT.D.S
+			if( rs2 != ( ( funct5 == 0x08 ) ? !dbl : 0 ) ) return -1;
+			break;
+		case 0x1a: // FCVT.fmt.W[U]
+			if( rs2 > 1 ) return -1;
+			op |= rs2;
+			break;
+		case 0x04: // FSGNJ, FSGNJN, FSGNJX
+		{
+			uint64_t signbit = dbl ? 0x8000000000000000ull : 0x80000000;
+			if( !dbl ) { a = MINIRV32_FUNBOX( a ); b = MINIRV32_FUNBOX( b ); }
+			switch( rm )
+			{
+				case 0: b &= signbit; break;
+				case 1: b = ~b & signbit; break;
+				case 2: b = ( a ^ b ) & signbit; break;
+				default: return -1;
+			}
+			a = ( a & ~signbit ) | b;
+			*result = dbl ? a : MINIRV32_FBOX( a );
+			return 0;
+		}
+		case 0x05: case 0x14: // FMIN, FMAX, FLE, FLT, FEQ
+		{
+			// Singles widen exactly.  Comparing NaNs is where RISC-V and C
+			// differ, so they never get as far as the host compare.
+			double fa = dbl ? MiniRV32IMAToD( a ) : MiniRV32IMAToF( MINIRV32_FUNBOX( a ) );
+			double fb = dbl ? MiniRV32IMAToD( b ) : MiniRV32IMAToF( MINIRV32_FUNBOX( b ) );
+			uint32_t ca = MiniRV32IMAFpuClass( dbl ? a : MINIRV32_FUNBOX( a ), dbl );
+			uint32_t cb = MiniRV32IMAFpuClass( dbl ? b : MINIRV32_FUNBOX( b ), dbl );
+			uint32_t nan = ( ca | cb ) & 0x300;
+			if( nan & 0x100 ) *fcsr |= 0x10; // Signaling NaNs are always invalid.
+			if( funct5 == 0x14 )
+			{
+				if( rm > 2 ) return -1;
+				if( nan && rm < 2 ) *fcsr |= 0x10; // FLT and FLE are signaling compares.
+				*result = nan ? 0 : ( rm == 0 ) ? ( fa <= fb ) : ( rm == 1 ) ? ( fa < fb ) : ( fa == fb );
+				return 1;
+			}
+			if( rm > 1 ) return -1;
+			if( ( ca & 0x300 ) && ( cb & 0x300 ) )
+				*result = dbl ? MINIRV32_FNAN64 : MINIRV32_FBOX( MINIRV32_FNAN32 );
+			else if( ( ca & 0x300 ) || ( cb & 0x300 ) )
+				*result = ( ca & 0x300 ) ? b : a;
+			else if( fa == fb ) // Only -0 vs +0 matters.
+				*result = ( ( ( ca & 0x8 ) != 0 ) ^ rm ) ? a : b;
+			else
+				*result = ( ( fa < fb ) ^ rm ) ? a : b;
+			if( !dbl ) *result = MINIRV32_FBOX( *result );
+			*fcsr |= MiniRV32IMAHostFlags();
+			return 0;
+		}
+		case 0x18: // FCVT.W[U].fmt
+			if( rs2 > 1 ) return -1;
+			if( rm == 7 ) rm = ( *fcsr >> 5 ) & 7;
+			if( rm > 4 ) return -1;
+			*result = MiniRV32IMAFpuToInt( dbl ? MiniRV32IMAToD( a ) : MiniRV32IMAToF( MINIRV32_FUNBOX( a ) ), rm, rs2, fcsr );
+			*fcsr |= MiniRV32IMAHostFlags();
+			return 1;
+		case 0x1c: // FMV.X.W, FCLASS
+			if( rs2 || rm > 1 || ( rm == 0 && dbl ) ) return -1;
+			*result = rm ? MiniRV32IMAFpuClass( dbl ? a : MINIRV32_FUNBOX( a ), dbl ) : (uint32_t)a;
+			return 1;
+		case 0x1e: // FMV.W.X
+			if( rs2 || rm || dbl ) return -1;
+			*result = MINIRV32_FBOX( x );
+			return 0;
+		default:
+			return -1;
+	}
+
+	if( rm == 7 ) rm = ( *fcsr >> 5 ) & 7;
+	if( rm > 4 )
+		return -1;
+	if( rm == 0 || rm == 4 ) // RNE, and RMM which the host can't do, so it's RNE too.
+		*result = MiniRV32IMAFpuCalc( op, dbl, a, b, c, x );
+	else
+	{
+		// Going through volatiles keeps the compiler from moving the math
+		// out from between the rounding mode changes.
+		volatile uint64_t va = a, vb = b, vc = c, vr;
+		fesetround( ( rm == 1 ) ? FE_TOWARDZERO : ( rm == 2 ) ? FE_DOWNWARD : FE_UPWARD );
+		vr = MiniRV32IMAFpuCalc( op, dbl, va, vb, vc, x );
+		fesetround( FE_TONEAREST );
+		*result = vr;
+	}
+	*fcsr |= MiniRV32IMAHostFlags();
+	return 0;
+}
+
+#endif
+
+#ifdef MINIRV32_GUARD_PAGES
+
+#ifndef MINIRV32_GUARD_PTR
+static struct MiniRV32IMAGuard minirv32_guard;
+#define MINIRV32_GUARD_PTR (&minirv32_guard)
+#endif
+
+// Checks only happen when retrying.  The PC is the real one, even for RVC.
+#define MINIRV32_GUARD_CHECK( x ) ( guard_retry && ( x ) )
+#define MINIRV32_GUARD_RETRY guard_retry
+#ifdef MINIRV32_RVC
+#define MINIRV32_GUARD_MARK() { MINIRV32_GUARD_PTR->pc = pc + rvc; MINIRV32_GUARD_PTR->cycle = cycle; }
+#else
+#define MINIRV32_GUARD_MARK() { MINIRV32_GUARD_PTR->pc = pc; MINIRV32_GUARD_PTR->cycle = cycle; }
+#endif
+
+#else
+
+#define MINIRV32_GUARD_CHECK( x ) ( x )
+#define MINIRV32_GUARD_RETRY 0
+#define MINIRV32_GUARD_MARK()
+
+#endif
+
+#ifdef MINIRV32_DECODE_CACHE
+
+#ifndef MINIRV32_DECODE_CACHE_PTR
+static struct MiniRV32IMADecodeCache minirv32_decode_cache;
+#define MINIRV32_DECODE_CACHE_PTR (&minirv32_decode_cache)
+#endif
+
+#define MINIRV32_DECODE_CACHE_STORE( ofs ) \
+	if( MINIRV32_DECODE_CACHE_PTR->codepages[((ofs)>>12)&(MINIRV32_DECODE_CACHE_PAGE_SLOTS-1)] ) \
+		MiniRV32IMAInvalidateDecodePage( MINIRV32_DECODE_CACHE_PTR, ofs )
+
+MINIRV32_DECORATE void MiniRV32IMAFlushDecodeCache( struct MiniRV32IMADecodeCache * cache )
+{
+	int i;
+#ifdef MINIRV32_BLOCK_CACHE
+	int j;
+	for( i = 0; i < (1<<MINIRV32_BLOCK_CACHE_BITS); i++ )
+		for( j = 0; j <= MINIRV32_BLOCK_MAX_OPS; j++ )
+			cache->blocks[i].ops[j].pc = 1;
+	for( i = 0; i < MINIRV32_BLOCK_RAS_SIZE; i++ )
+		cache->ras[i] = 0;
+#ifdef MINIRV32_JIT
+	cache->jitused = 0; // Nothing can reach the old code anymore.
+#endif
+#else
+	for( i = 0; i < (1<<MINIRV32_DECODE_CACHE_BITS); i++ )
+		cache->entries[i].pc = 1;
+#endif
+	for( i = 0; i < MINIRV32_DECODE_CACHE_PAGE_SLOTS; i++ )
+		cache->codepages[i] = 0;
+}
+
+// ofs is the offset into RAM of the byte that was written.
+MINIRV32_DECORATE void MiniRV32IMAInvalidateDecodePage( struct MiniRV32IMADecodeCache * cache, uint32_t ofs )
+{
+	// Every page that aliases into this slot lands on the same 1024 entries,
+	// as long as the cache is no bigger than PAGE_SLOTS pages worth.
+	uint32_t slot = ( ofs >> 12 ) & ( MINIRV32_DECODE_CACHE_PAGE_SLOTS - 1 );
+	uint32_t base = ( ofs >> 2 ) & ~1023;
+	int i;
+	cache->codepages[slot] = 0;
+#ifdef MINIRV32_BLOCK_CACHE
+	for( i = 0; i < 1024 && i < (1<<MINIRV32_BLOCK_CACHE_BITS); i++ )
+	{
+		struct MiniRV32IMABlock * b = &cache->blocks[( base + i ) & ((1<<MINIRV32_BLOCK_CACHE_BITS)-1)];
+		if( ( ( ( b->ops[0].pc - MINIRV32_RAM_IMAGE_OFFSET ) >> 12 ) & ( MINIRV32_DECODE_CACHE_PAGE_SLOTS - 1 ) ) == slot )
+		{
+			uint32_t j;
+			for( j = 0; j < b->len; j++ )
+				b->ops[j].pc = 1;
+		}
+	}
+#else
+	for( i = 0; i < 1024; i++ )
+	{
+		struct MiniRV32IMADecoded * d = &cache->entries[( base + i ) & ((1<<MINIRV32_DECODE_CACHE_BITS)-1)];
+		if( ( ( ( d->pc - MINIRV32_RAM_IMAGE_OFFSET ) >> 12 ) & ( MINIRV32_DECODE_CACHE_PAGE_SLOTS - 1 ) ) == slot )
+			d->pc = 1;
+	}
+#endif
+}
+
+static void MiniRV32IMADecode( struct MiniRV32IMADecodeCache * cache, struct MiniRV32IMADecoded * d, uint32_t pc, uint32_t ir )
+{
+	uint32_t imm = ir >> 20;
+	int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
+	uint32_t funct3 = ( ir >> 12 ) & 7;
+	uint32_t op = MINIRV32_DOP_SLOW;
+
+	d->pc = 1;
+	d->ir = ir;
+	d->rd = (ir >> 7) & 0x1f;
+	d->rs1 = (ir >> 15) & 0x1f;
+	d->rs2 = (ir >> 20) & 0x1f;
+	d->imm = imm_se;
+
+#ifdef MINIRV32_ZB
+	if( ( ir & 0x7f ) == 0x13 || ( ir & 0x7f ) == 0x33 )
+	{
+		uint32_t unused;
+		if( MiniRV32IMABitmanip( ir, 0, imm_se, &unused ) )
+			op = MINIRV32_DOP_BITMANIP;
+	}
+	if( op == MINIRV32_DOP_SLOW )
+#endif
+	switch( ir & 0x7f )
+	{
+		case 0x37: op = MINIRV32_DOP_LI; d->imm = ir & 0xfffff000; break; // LUI
+		case 0x17: op = MINIRV32_DOP_LI; d->imm = pc + ( ir & 0xfffff000 ); break; // AUIPC
+		case 0x6F: // JAL
+		{
+			int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
+			if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
+			op = MINIRV32_DOP_JAL;
+			d->imm = pc + reladdy - 4;
+			break;
+		}
+		case 0x67: op = MINIRV32_DOP_JALR; break;
+		case 0x63: // Branch
+		{
+			static const uint8_t bops[8] = { MINIRV32_DOP_BEQ, MINIRV32_DOP_BNE, MINIRV32_DOP_SLOW, MINIRV32_DOP_SLOW,
+				MINIRV32_DOP_BLT, MINIRV32_DOP_BGE, MINIRV32_DOP_BLTU, MINIRV32_DOP_BGEU };
+			uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
+			if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
+			op = bops[funct3];
+			d->imm = pc + immm4 - 4;
+			d->rd = 0;
+			break;
+		}
+		case 0x03: // Load
+		{
+			static const uint8_t lops[8] = { MINIRV32_DOP_LB, MINIRV32_DOP_LH, MINIRV32_DOP_LW, MINIRV32_DOP_SLOW,
+				MINIRV32_DOP_LBU, MINIRV32_DOP_LHU, MINIRV32_DOP_SLOW, MINIRV32_DOP_SLOW };
+			op = lops[funct3];
+			break;
+		}
+		case 0x23: // Store
+		{
+			uint32_t addy = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
+			if( addy & 0x800 ) addy |= 0xfffff000;
+			if( funct3 < 3 ) op = MINIRV32_DOP_SB + funct3;
+			d->imm = addy;
+			d->rd = 0;
+			break;
+		}
+		case 0x13: // Op-immediate
+		{
+			static const uint8_t iops[8] = { MINIRV32_DOP_ADDI, MINIRV32_DOP_SLLI, MINIRV32_DOP_SLTI, MINIRV32_DOP_SLTIU,
+				MINIRV32_DOP_XORI, MINIRV32_DOP_SRLI, MINIRV32_DOP_ORI, MINIRV32_DOP_ANDI };
+			op = iops[funct3];
+			if( funct3 == 5 && ( ir & 0x40000000 ) ) op = MINIRV32_DOP_SRAI;
+			if( funct3 == 1 || funct3 == 5 ) d->imm &= 0x1f;
+			break;
+		}
+		case 0x33: // Op
+		{
+			static const uint8_t rops[8] = { MINIRV32_DOP_ADD, MINIRV32_DOP_SLL, MINIRV32_DOP_SLT, MINIRV32_DOP_SLTU,
+				MINIRV32_DOP_XOR, MINIRV32_DOP_SRL, MINIRV32_DOP_OR, MINIRV32_DOP_AND };
+			if( ir & 0x02000000 )
+			{
+				op = MINIRV32_DOP_MUL + funct3;
+#ifdef CUSTOM_MULH
+				if( funct3 >= 1 && funct3 <= 3 ) op = MINIRV32_DOP_SLOW;
+#endif
+			}
+			else
+			{
+				op = rops[funct3];
+				if( ir & 0x40000000 )
+				{
+					if( funct3 == 0 ) op = MINIRV32_DOP_SUB;
+					else if( funct3 == 5 ) op = MINIRV32_DOP_SRA;
+				}
+			}
+			break;
+		}
+	}
+
+	d->op = op;
+	d->pc = pc;
+	cache->codepages[((pc - MINIRV32_RAM_IMAGE_OFFSET)>>12)&(MINIRV32_DECODE_CACHE_PAGE_SLOTS-1)] = 1;
+}
+
+#ifdef MINIRV32_FUSION
+
+// Macro-op fusion.  d was just decoded from pc, and ir2 is the instruction
+// after it, which must be in the same 4kB page so invalidating either half
+// invalidates the pair.  If the second one only consumes what the first one
+// produced, turn d into a fused op that does both.  d->ir stays the first
+// instruction, so the full decoder can still run just that half.  Returns
+// nonzero if the pair was fused.
+static int MiniRV32IMAFuse( struct MiniRV32IMADecodeCache * cache, struct MiniRV32IMADecoded * d, uint32_t pc, uint32_t ir2 )
+{
+	struct MiniRV32IMADecoded s;
+	if( !d->rd )
+		return 0;
+	MiniRV32IMADecode( cache, &s, pc + 4, ir2 );
+	if( s.rs1 != d->rd )
+		return 0;
+
+	switch( d->op )
+	{
+		case MINIRV32_DOP_LI:
+			if( s.op == MINIRV32_DOP_ADDI )
+			{
+				d->op = ( ( d->ir & 0x7f ) == 0x37 ) ? MINIRV32_DOP_FUSE_LUI_ADDI : MINIRV32_DOP_FUSE_AUIPC_ADDI;
+				d->imm2 = d->imm + s.imm;
+			}
+			else if( s.op == MINIRV32_DOP_JALR && ( d->ir & 0x7f ) == 0x17 )
+			{
+				d->op = MINIRV32_DOP_FUSE_AUIPC_JALR;
+				d->imm2 = ( ( d->imm + s.imm ) & ~1 ) - 4;
+			}
+			else
+				return 0;
+			d->rd2 = s.rd;
+			return 1;
+		case MINIRV32_DOP_SLLI:
+			if( s.op != MINIRV32_DOP_SRLI )
+				return 0;
+			d->op = MINIRV32_DOP_FUSE_SLLI_SRLI;
+			d->rd2 = s.rd;
+			d->imm2 = s.imm;
+			return 1;
+		case MINIRV32_DOP_SLT: case MINIRV32_DOP_SLTU: case MINIRV32_DOP_SLTI: case MINIRV32_DOP_SLTIU:
+			// beqz / bnez on the result.
+			if( ( s.op != MINIRV32_DOP_BEQ && s.op != MINIRV32_DOP_BNE ) || s.rs2 )
+				return 0;
+			switch( d->op )
+			{
+				case MINIRV32_DOP_SLT: d->op = MINIRV32_DOP_FUSE_SLT_BR; break;
+				case MINIRV32_DOP_SLTU: d->op = MINIRV32_DOP_FUSE_SLTU_BR; break;
+				case MINIRV32_DOP_SLTI: d->op = MINIRV32_DOP_FUSE_SLTI_BR; break;
+				default: d->op = MINIRV32_DOP_FUSE_SLTIU_BR; break;
+			}
+			d->rd2 = ( s.op == MINIRV32_DOP_BEQ );
+			d->imm2 = s.imm;
+			return 1;
+	}
+	return 0;
+}
+
+#endif
+
+#ifdef MINIRV32_BLOCK_CACHE
+
+#ifdef MINIRV32_FUSION
+#define MINIRV32_DOP_ENDS_BLOCK( op ) ( (op) == MINIRV32_DOP_SLOW || ( (op) >= MINIRV32_DOP_JAL && (op) <= MINIRV32_DOP_BGEU ) || (op) >= MINIRV32_DOP_FUSE_AUIPC_JALR )
+#else
+#define MINIRV32_DOP_ENDS_BLOCK( op ) ( (op) == MINIRV32_DOP_SLOW || ( (op) >= MINIRV32_DOP_JAL && (op) <= MINIRV32_DOP_BGEU ) )
+#endif
+
+// pc must be in RAM and aligned.
+static struct MiniRV32IMABlock * MiniRV32IMATranslateBlock( struct MiniRV32IMADecodeCache * cache, uint8_t * image, uint32_t pc )
+{
+	uint32_t ofs_pc = pc - MINIRV32_RAM_IMAGE_OFFSET;
+	struct MiniRV32IMABlock * b = &cache->blocks[(ofs_pc>>2)&((1<<MINIRV32_BLOCK_CACHE_BITS)-1)];
+	uint32_t n = 0;
+	uint32_t op;
+
+	if( b->ops[0].pc == pc )
+		return b;
+
+	do
+	{
+		MiniRV32IMADecode( cache, &b->ops[n], pc, MINIRV32_LOAD4( ofs_pc ) );
+#ifdef MINIRV32_FUSION
+		if( ( ( ofs_pc + 4 ) & 0xfff ) && ofs_pc + 4 < MINI_RV32_RAM_SIZE-3 &&
+			MiniRV32IMAFuse( cache, &b->ops[n], pc, MINIRV32_LOAD4( ofs_pc + 4 ) ) )
+		{
+			pc += 4;
+			ofs_pc += 4;
+		}
+#endif
+		op = b->ops[n++].op;
+		pc += 4;
+		ofs_pc += 4;
+	} while( n < MINIRV32_BLOCK_MAX_OPS && !MINIRV32_DOP_ENDS_BLOCK( op ) && ( ofs_pc & 0xfff ) && ofs_pc < MINI_RV32_RAM_SIZE-3 );
+
+	b->ops[n].pc = 1;
+	b->len = n;
+	b->endpc = pc;
+	b->exitkind = 0;
+	if( op == MINIRV32_DOP_JAL || op == MINIRV32_DOP_JALR )
+	{
+		struct MiniRV32IMADecoded * last = &b->ops[n-1];
+		if( last->rd == 1 || last->rd == 5 )
+			b->exitkind = 1;
+		else if( op == MINIRV32_DOP_JALR && ( last->rs1 == 1 || last->rs1 == 5 ) )
+			b->exitkind = 2;
+	}
+#ifdef MINIRV32_FUSION
+	else if( op == MINIRV32_DOP_FUSE_AUIPC_JALR && ( b->ops[n-1].rd2 == 1 || b->ops[n-1].rd2 == 5 ) )
+		b->exitkind = 1;
+#endif
+	b->next[0] = b->next[1] = b;
+#ifdef MINIRV32_JIT
+	b->hits = 0;
+	b->native = 0;
+#endif
+	return b;
+}
+
+// Called every time we leave a block.  from is the block we were in, or 0.
+static struct MiniRV32IMABlock * MiniRV32IMANextBlock( struct MiniRV32IMADecodeCache * cache, struct MiniRV32IMABlock * from, uint8_t * image, uint32_t pc )
+{
+	struct MiniRV32IMABlock * b;
+	uint32_t taken;
+
+	if( !from )
+		return MiniRV32IMATranslateBlock( cache, image, pc );
+
+	taken = ( pc != from->endpc );
+
+	if( from->exitkind == 1 )
+	{
+		// A call, remember where it will come back to.
+		uint32_t ret = from->endpc - MINIRV32_RAM_IMAGE_OFFSET;
+		cache->ras[(++cache->rastop)&(MINIRV32_BLOCK_RAS_SIZE-1)] = &cache->blocks[(ret>>2)&((1<<MINIRV32_BLOCK_CACHE_BITS)-1)];
+	}
+	else if( from->exitkind == 2 )
+	{
+		// A return, see if it's going where the matching call said.
+		b = cache->ras[(cache->rastop--)&(MINIRV32_BLOCK_RAS_SIZE-1)];
+		if( b && b->ops[0].pc == pc )
+			return b;
+	}
+
+	b = from->next[taken];
+	if( b->ops[0].pc == pc )
+		return b;
+
+	b = MiniRV32IMATranslateBlock( cache, image, pc );
+	from->next[taken] = b;
+	return b;
+}
+
+#ifdef MINIRV32_JIT
+#include "mini-rv32ima-jit.h"
+#endif
+
+#endif
+
+#else
+#define MINIRV32_DECODE_CACHE_STORE( ofs )
+#endif
+
+#ifdef MINIRV32_RVC
+
+// Turns a 16-bit RVC instruction into the 32-bit instruction it stands for,
+// or 0 (an illegal instruction) if it's reserved or needs an extension that
+// isn't here.  The step runs it as if it sat 2 bytes before its real PC, so
+// falling through still moves on by 4 and a link register still gets the
+// next instruction; to make up for that, PC-relative offsets get 2 added.
+MINIRV32_DECORATE uint32_t MiniRV32IMAExpandC( uint32_t c )
+{
+	#define MINIRV32_C_I( op, f3, rd, rs1, imm ) ( ( (uint32_t)(imm) << 20 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | ( (rd) << 7 ) | (op) )
+	#define MINIRV32_C_S( op, f3, rs1, rs2, imm ) ( ( ( (imm) >> 5 ) << 25 ) | ( (rs2) << 20 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | ( ( (imm) & 0x1f ) << 7 ) | (op) )
+	#define MINIRV32_C_R( f7, f3, rd, rs1, rs2 ) ( ( (f7) << 25 ) | ( (rs2) << 20 ) | ( (rs1) << 15 ) | ( (f3) << 12 ) | ( (rd) << 7 ) | 0x33 )
+	uint32_t rd = ( c >> 7 ) & 0x1f; // Also rs1 for most.
+	uint32_t rs2 = ( c >> 2 ) & 0x1f;
+	uint32_t rdp = ( ( c >> 2 ) & 7 ) + 8; // rd' / rs2'
+	uint32_t rs1p = ( ( c >> 7 ) & 7 ) + 8;
+	int32_t imm6 = ( ( c >> 2 ) & 0x1f ) | ( ( c & 0x1000 ) ? 0xffffffe0 : 0 ); // CI format
+	uint32_t uimm;
+	int32_t imm;
+
+	switch( ( ( c & 3 ) << 3 ) | ( c >> 13 ) )
+	{
+		case 000: // C.ADDI4SPN
+			uimm = ( ( c >> 7 ) & 0x30 ) | ( ( c >> 1 ) & 0x3c0 ) | ( ( c >> 4 ) & 4 ) | ( ( c >> 2 ) & 8 );
+			return uimm ? MINIRV32_C_I( 0x13, 0, rdp, 2, uimm ) : 0;
+		case 002: // C.LW
+			uimm = ( ( c >> 7 ) & 0x38 ) | ( ( c >> 4 ) & 4 ) | ( ( c << 1 ) & 0x40 );
+			return MINIRV32_C_I( 0x03, 2, rdp, rs1p, uimm );
+		case 006: // C.SW
+			uimm = ( ( c >> 7 ) & 0x38 ) | ( ( c >> 4 ) & 4 ) | ( ( c << 1 ) & 0x40 );
+			return MINIRV32_C_S( 0x23, 2, rs1p, rdp, uimm );
+		case 010: // C.ADDI, C.NOP
+			return MINIRV32_C_I( 0x13, 0, rd, rd, imm6 & 0xfff );
+		case 011: // C.JAL
+		case 015: // C.J
+			imm = ( ( c >> 1 ) & 0x800 ) | ( ( c >> 7 ) & 0x10 ) | ( ( c >> 1 ) & 0x300 ) | ( ( c << 2 ) & 0x400 ) |
+				( ( c >> 1 ) & 0x40 ) | ( ( c << 1 ) & 0x80 ) | ( ( c >> 2 ) & 0xe ) | ( ( c << 3 ) & 0x20 );
+			imm = ( ( imm & 0x800 ) ? ( imm | 0xfffff000 ) : imm ) + 2;
+			return ( ( imm & 0x100000 ) << 11 ) | ( ( imm & 0x7fe ) << 20 ) | ( ( imm & 0x800 ) << 9 ) | ( imm & 0xff000 ) |
+				( ( ( c >> 13 ) == 1 ) << 7 ) | 0x6f;
+		case 012: // C.LI
+			return MINIRV32_C_I( 0x13, 0, rd, 0, imm6 & 0xfff );
+		case 013:
+			if( rd == 2 ) // C.ADDI16SP
+			{
+				imm = ( ( c >> 3 ) & 0x200 ) | ( ( c >> 2 ) & 0x10 ) | ( ( c << 1 ) & 0x40 ) | ( ( c << 4 ) & 0x180 ) | ( ( c << 3 ) & 0x20 );
+				if( !imm ) return 0;
+				return MINIRV32_C_I( 0x13, 0, 2, 2, ( ( imm & 0x200 ) ? ( imm | 0xfffffc00 ) : imm ) & 0xfff );
+			}
+			// C.LUI
+			if( !imm6 ) return 0;
+			return ( imm6 << 12 ) | ( rd << 7 ) | 0x37;
+		case 014:
+			switch( ( c >> 10 ) & 3 )
+			{
+				case 0: // C.SRLI
+				case 1: // C.SRAI
+					if( c & 0x1000 ) return 0; // shamt[5] is for RV64.
+					return MINIRV32_C_I( 0x13, 5, rs1p, rs1p, rs2 | ( ( c & 0x400 ) ? 0x400 : 0 ) );
+				case 2: // C.ANDI
+					return MINIRV32_C_I( 0x13, 7, rs1p, rs1p, imm6 & 0xfff );
+				default:
+					if( c & 0x1000 ) return 0; // C.SUBW, C.ADDW are RV64.
+					switch( ( c >> 5 ) & 3 )
+					{
+						case 0: return MINIRV32_C_R( 0x20, 0, rs1p, rs1p, rdp ); // C.SUB
+						case 1: return MINIRV32_C_R( 0, 4, rs1p, rs1p, rdp ); // C.XOR
+						case 2: return MINIRV32_C_R( 0, 6, rs1p, rs1p, rdp ); // C.OR
+						default: return MINIRV32_C_R( 0, 7, rs1p, rs1p, rdp ); // C.AND
+					}
+			}
+		case 016: // C.BEQZ
+		case 017: // C.BNEZ
+			imm = ( ( c >> 4 ) & 0x100 ) | ( ( c >> 7 ) & 0x18 ) | ( ( c << 1 ) & 0xc0 ) | ( ( c >> 2 ) & 6 ) | ( ( c << 3 ) & 0x20 );
+			imm = ( ( imm & 0x100 ) ? ( imm | 0xfffffe00 ) : imm ) + 2;
+			return ( ( imm & 0x1000 ) << 19 ) | ( ( imm & 0x7e0 ) << 20 ) | ( rs1p << 15 ) | ( ( c >> 13 ) & 1 ) << 12 |
+				( ( imm & 0x1e ) << 7 ) | ( ( imm & 0x800 ) >> 4 ) | 0x63;
+		case 020: // C.SLLI
+			if( c & 0x1000 ) return 0;
+			return MINIRV32_C_I( 0x13, 1, rd, rd, rs2 );
+		case 022: // C.LWSP
+			if( !rd ) return 0;
+			uimm = ( ( c >> 7 ) & 0x20 ) | ( ( c >> 2 ) & 0x1c ) | ( ( c << 4 ) & 0xc0 );
+			return MINIRV32_C_I( 0x03, 2, rd, 2, uimm );
+		case 024:
+			if( !( c & 0x1000 ) )
+			{
+				if( rs2 ) return MINIRV32_C_R( 0, 0, rd, 0, rs2 ); // C.MV
+				return rd ? MINIRV32_C_I( 0x67, 0, 0, rd, 0 ) : 0; // C.JR
+			}
+			if( rs2 ) return MINIRV32_C_R( 0, 0, rd, rd, rs2 ); // C.ADD
+			return rd ? MINIRV32_C_I( 0x67, 0, 1, rd, 0 ) : 0x00100073; // C.JALR, C.EBREAK
+		case 026: // C.SWSP
+			uimm = ( ( c >> 7 ) & 0x3c ) | ( ( c >> 1 ) & 0xc0 );
+			return MINIRV32_C_S( 0x23, 2, 2, rs2, uimm );
+#ifdef MINIRV32_FPU
+		case 001: // C.FLD
+		case 005: // C.FSD
+			uimm = ( ( c >> 7 ) & 0x38 ) | ( ( c << 1 ) & 0xc0 );
+			return ( c & 0x8000 ) ? MINIRV32_C_S( 0x27, 3, rs1p, rdp, uimm ) : MINIRV32_C_I( 0x07, 3, rdp, rs1p, uimm );
+		case 003: // C.FLW
+		case 007: // C.FSW
+			uimm = ( ( c >> 7 ) & 0x38 ) | ( ( c >> 4 ) & 4 ) | ( ( c << 1 ) & 0x40 );
+			return ( c & 0x8000 ) ? MINIRV32_C_S( 0x27, 2, rs1p, rdp, uimm ) : MINIRV32_C_I( 0x07, 2, rdp, rs1p, uimm );
+		case 021: // C.FLDSP
+			uimm = ( ( c >> 7 ) & 0x20 ) | ( ( c >> 2 ) & 0x18 ) | ( ( c << 4 ) & 0x1c0 );
+			return MINIRV32_C_I( 0x07, 3, rd, 2, uimm );
+		case 023: // C.FLWSP, f0 is fine.
+			uimm = ( ( c >> 7 ) & 0x20 ) | ( ( c >> 2 ) & 0x1c ) | ( ( c << 4 ) & 0xc0 );
+			return MINIRV32_C_I( 0x07, 2, rd, 2, uimm );
+		case 025: // C.FSDSP
+			uimm = ( ( c >> 7 ) & 0x38 ) | ( ( c >> 1 ) & 0x1c0 );
+			return MINIRV32_C_S( 0x27, 3, 2, rs2, uimm );
+		case 027: // C.FSWSP
+			uimm = ( ( c >> 7 ) & 0x3c ) | ( ( c >> 1 ) & 0xc0 );
+			return MINIRV32_C_S( 0x27, 2, 2, rs2, uimm );
+#endif
+		default: // Floating point loads and stores, without MINIRV32_FPU.
+			return 0;
+	}
+	#undef MINIRV32_C_I
+	#undef MINIRV32_C_S
+	#undef MINIRV32_C_R
+}
+
 #endif
 
 #ifndef MINIRV32_STEPPROTO
@@ -138,12 +1227,52 @@ MINIRV32_STEPPROTO
 	if( CSR( extraflags ) & 4 )
 		return 1;
 
+#ifdef MINIRV32_FPU
+	MINIRV32_FPU_CLEARFLAGS(); // Whatever the host, or another hart, was doing.
+#endif
+
 	uint32_t trap = 0;
 	uint32_t rval = 0;
 	uint32_t pc = CSR( pc );
 	uint32_t cycle = CSR( cyclel );
+#ifdef MINIRV32_DISPATCH_GOTO
+	static const void * const minirv32_op_tbl[128] = { [0 ... 127] = MINIRV32_LABEL( op, default ),
+		[0x37] = MINIRV32_LABEL( op, 0x37 ), [0x17] = MINIRV32_LABEL( op, 0x17 ), [0x6F] = MINIRV32_LABEL( op, 0x6F ),
+		[0x67] = MINIRV32_LABEL( op, 0x67 ), [0x63] = MINIRV32_LABEL( op, 0x63 ), [0x03] = MINIRV32_LABEL( op, 0x03 ),
+		[0x23] = MINIRV32_LABEL( op, 0x23 ), [0x13] = MINIRV32_LABEL( op, 0x13 ), [0x33] = MINIRV32_LABEL( op, 0x33 ),
+		[0x0f] = MINIRV32_LABEL( op, 0x0f ), [0x73] = MINIRV32_LABEL( op, 0x73 ), [0x2f] = MINIRV32_LABEL( op, 0x2f ),
+#ifdef MINIRV32_FPU
+		[0x07] = MINIRV32_LABEL( op, 0x07 ), [0x27] = MINIRV32_LABEL( op, 0x27 ), [0x43] = MINIRV32_LABEL( op, 0x43 ),
+		[0x47] = MINIRV32_LABEL( op, 0x47 ), [0x4b] = MINIRV32_LABEL( op, 0x4b ), [0x4f] = MINIRV32_LABEL( op, 0x4f ),
+		[0x53] = MINIRV32_LABEL( op, 0x53 ),
+#endif
+		};
+#endif
+#ifdef MINIRV32_BLOCK_CACHE
+	struct MiniRV32IMADecoded nomatch = { 1 };
+	struct MiniRV32IMADecoded * nextop = &nomatch;
+	struct MiniRV32IMABlock * blk = 0;
+#endif
+#ifdef MINIRV32_GUARD_PAGES
+	int guard_retry = 0;
+	if( sigsetjmp( MINIRV32_GUARD_PTR->jmp, 0 ) )
+	{
+		// An access faulted.  Nothing it did stuck, so pick up from just
+		// before it, and check everything from here on.
+		count -= MINIRV32_GUARD_PTR->cycle - CSR( cyclel ) - 1;
+		pc = MINIRV32_GUARD_PTR->pc;
+		cycle = MINIRV32_GUARD_PTR->cycle - 1;
+		trap = 0;
+		rval = 0;
+#ifdef MINIRV32_BLOCK_CACHE
+		nextop = &nomatch;
+		blk = 0;
+#endif
+		guard_retry = 1;
+	}
+#endif
 
-	if( ( CSR( mip ) & (1<<7) ) && ( CSR( mie ) & (1<<7) /*mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	if( !MINIRV32_GUARD_RETRY && ( CSR( mip ) & (1<<7) ) && ( CSR( mie ) & (1<<7) /*mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
 	{
 		// Timer interrupt.
 		trap = 0x80000007;
@@ -153,6 +1282,9 @@ MINIRV32_STEPPROTO
 	for( int icount = 0; icount < count; icount++ )
 	{
 		uint32_t ir = 0;
+#ifdef MINIRV32_RVC
+		uint32_t rvc = 0; // 2 if running an expanded compressed instruction.
+#endif
 		rval = 0;
 		cycle++;
 		uint32_t ofs_pc = pc - MINIRV32_RAM_IMAGE_OFFSET;
@@ -162,25 +1294,267 @@ MINIRV32_STEPPROTO
 			trap = 1 + 1;  // Handle access violation on instruction read.
 			break;
 		}
+#ifdef MINIRV32_RVC
+		else if( ofs_pc & 1 )
+#else
 		else if( ofs_pc & 3 )
+#endif
 		{
 			trap = 1 + 0;  //Handle PC-misaligned access
 			break;
 		}
 		else
 		{
+#ifdef MINIRV32_DECODE_CACHE
+#ifdef MINIRV32_BLOCK_CACHE
+			// Keep walking the current block, only go looking for the next one
+			// once we branch, run off the end, or the block gets invalidated.
+			struct MiniRV32IMADecoded * dec = nextop++;
+			if( dec->pc != pc )
+			{
+				struct MiniRV32IMABlock * b;
+				if( blk && !blk->exitkind && ( b = blk->next[pc != blk->endpc] )->ops[0].pc == pc )
+					blk = b;
+				else
+					blk = MiniRV32IMANextBlock( MINIRV32_DECODE_CACHE_PTR, blk, image, pc );
+				dec = blk->ops;
+				nextop = dec + 1;
+#ifdef MINIRV32_JIT
+				if( blk->len <= count - icount && MiniRV32IMAJitReady( MINIRV32_DECODE_CACHE_PTR, blk ) )
+				{
+					// Translated code returns how many instructions it retired in the
+					// top half, and where to go next in the bottom.  If it stopped
+					// early, the interpreter picks up from that instruction.
+					uint64_t r = ((MiniRV32IMANativeBlock)blk->native)( state, image );
+					uint32_t ran = r >> 32;
+					if( ran )
+					{
+						pc = (uint32_t)r;
+						nextop = blk->ops + ran;
+						icount += ran - 1;
+						cycle += ran - 1;
+						continue;
+					}
+				}
+#endif
+			}
+#else
+			struct MiniRV32IMADecoded * dec = &MINIRV32_DECODE_CACHE_PTR->entries[(ofs_pc>>2)&((1<<MINIRV32_DECODE_CACHE_BITS)-1)];
+			if( dec->pc != pc )
+			{
+				MiniRV32IMADecode( MINIRV32_DECODE_CACHE_PTR, dec, pc, MINIRV32_LOAD4( ofs_pc ) );
+#ifdef MINIRV32_FUSION
+				if( ( ( ofs_pc + 4 ) & 0xfff ) && ofs_pc + 4 < MINI_RV32_RAM_SIZE-3 )
+					MiniRV32IMAFuse( MINIRV32_DECODE_CACHE_PTR, dec, pc, MINIRV32_LOAD4( ofs_pc + 4 ) );
+#endif
+			}
+#endif
+			uint32_t rdid, slowpath;
+#ifdef MINIRV32_BLOCK_CACHE
+		nextblockop:
+#endif
+			ir = dec->ir;
+			rdid = dec->rd;
+			slowpath = 0;
+
+			// Fast path, for anything that was fully decoded.  Memory accesses
+			// outside of RAM bail out to the full decoder below.
+			switch( dec->op )
+			{
+				case MINIRV32_DOP_LI: rval = dec->imm; break;
+				case MINIRV32_DOP_JAL: rval = pc + 4; pc = dec->imm; break;
+				case MINIRV32_DOP_JALR: rval = pc + 4; pc = ( (REG( dec->rs1 ) + dec->imm) & ~1) - 4; break;
+				case MINIRV32_DOP_BEQ: if( REG( dec->rs1 ) == REG( dec->rs2 ) ) pc = dec->imm; break;
+				case MINIRV32_DOP_BNE: if( REG( dec->rs1 ) != REG( dec->rs2 ) ) pc = dec->imm; break;
+				case MINIRV32_DOP_BLT: if( (int32_t)REG( dec->rs1 ) < (int32_t)REG( dec->rs2 ) ) pc = dec->imm; break;
+				case MINIRV32_DOP_BGE: if( (int32_t)REG( dec->rs1 ) >= (int32_t)REG( dec->rs2 ) ) pc = dec->imm; break;
+				case MINIRV32_DOP_BLTU: if( REG( dec->rs1 ) < REG( dec->rs2 ) ) pc = dec->imm; break;
+				case MINIRV32_DOP_BGEU: if( REG( dec->rs1 ) >= REG( dec->rs2 ) ) pc = dec->imm; break;
+				case MINIRV32_DOP_LB: case MINIRV32_DOP_LH: case MINIRV32_DOP_LW: case MINIRV32_DOP_LBU: case MINIRV32_DOP_LHU:
+				{
+					uint32_t rsval = REG( dec->rs1 ) + dec->imm - MINIRV32_RAM_IMAGE_OFFSET;
+					if( MINIRV32_GUARD_CHECK( rsval >= MINI_RV32_RAM_SIZE-3 ) ) { slowpath = 1; break; }
+					MINIRV32_GUARD_MARK();
+					switch( dec->op )
+					{
+						case MINIRV32_DOP_LB: rval = MINIRV32_LOAD1_SIGNED( rsval ); break;
+						case MINIRV32_DOP_LH: rval = MINIRV32_LOAD2_SIGNED( rsval ); break;
+						case MINIRV32_DOP_LW: rval = MINIRV32_LOAD4( rsval ); break;
+						case MINIRV32_DOP_LBU: rval = MINIRV32_LOAD1( rsval ); break;
+						default: rval = MINIRV32_LOAD2( rsval ); break;
+					}
+					break;
+				}
+				case MINIRV32_DOP_SB: case MINIRV32_DOP_SH: case MINIRV32_DOP_SW:
+				{
+					uint32_t rs2 = REG( dec->rs2 );
+					uint32_t addy = REG( dec->rs1 ) + dec->imm - MINIRV32_RAM_IMAGE_OFFSET;
+					if( MINIRV32_GUARD_CHECK( addy >= MINI_RV32_RAM_SIZE-3 ) ) { slowpath = 1; break; }
+					MINIRV32_GUARD_MARK();
+					switch( dec->op )
+					{
+						case MINIRV32_DOP_SB: MINIRV32_STORE1( addy, rs2 ); break;
+						case MINIRV32_DOP_SH: MINIRV32_STORE2( addy, rs2 ); break;
+						default: MINIRV32_STORE4( addy, rs2 ); break;
+					}
+					MINIRV32_DECODE_CACHE_STORE( addy );
+					break;
+				}
+				case MINIRV32_DOP_ADDI: rval = REG( dec->rs1 ) + dec->imm; break;
+				case MINIRV32_DOP_SLTI: rval = (int32_t)REG( dec->rs1 ) < dec->imm; break;
+				case MINIRV32_DOP_SLTIU: rval = REG( dec->rs1 ) < (uint32_t)dec->imm; break;
+				case MINIRV32_DOP_XORI: rval = REG( dec->rs1 ) ^ dec->imm; break;
+				case MINIRV32_DOP_ORI: rval = REG( dec->rs1 ) | dec->imm; break;
+				case MINIRV32_DOP_ANDI: rval = REG( dec->rs1 ) & dec->imm; break;
+				case MINIRV32_DOP_SLLI: rval = REG( dec->rs1 ) << dec->imm; break;
+				case MINIRV32_DOP_SRLI: rval = REG( dec->rs1 ) >> dec->imm; break;
+				case MINIRV32_DOP_SRAI: rval = ((int32_t)REG( dec->rs1 )) >> dec->imm; break;
+				case MINIRV32_DOP_ADD: rval = REG( dec->rs1 ) + REG( dec->rs2 ); break;
+				case MINIRV32_DOP_SUB: rval = REG( dec->rs1 ) - REG( dec->rs2 ); break;
+				case MINIRV32_DOP_SLL: rval = REG( dec->rs1 ) << ( REG( dec->rs2 ) & 0x1F ); break;
+				case MINIRV32_DOP_SLT: rval = (int32_t)REG( dec->rs1 ) < (int32_t)REG( dec->rs2 ); break;
+				case MINIRV32_DOP_SLTU: rval = REG( dec->rs1 ) < REG( dec->rs2 ); break;
+				case MINIRV32_DOP_XOR: rval = REG( dec->rs1 ) ^ REG( dec->rs2 ); break;
+				case MINIRV32_DOP_SRL: rval = REG( dec->rs1 ) >> ( REG( dec->rs2 ) & 0x1F ); break;
+				case MINIRV32_DOP_SRA: rval = ((int32_t)REG( dec->rs1 )) >> ( REG( dec->rs2 ) & 0x1F ); break;
+				case MINIRV32_DOP_OR: rval = REG( dec->rs1 ) | REG( dec->rs2 ); break;
+				case MINIRV32_DOP_AND: rval = REG( dec->rs1 ) & REG( dec->rs2 ); break;
+				case MINIRV32_DOP_MUL: rval = REG( dec->rs1 ) * REG( dec->rs2 ); break;
+#ifndef CUSTOM_MULH
+				case MINIRV32_DOP_MULH: rval = ((int64_t)((int32_t)REG( dec->rs1 )) * (int64_t)((int32_t)REG( dec->rs2 ))) >> 32; break;
+				case MINIRV32_DOP_MULHSU: rval = ((int64_t)((int32_t)REG( dec->rs1 )) * (uint64_t)REG( dec->rs2 )) >> 32; break;
+				case MINIRV32_DOP_MULHU: rval = ((uint64_t)REG( dec->rs1 ) * (uint64_t)REG( dec->rs2 )) >> 32; break;
+#endif
+				case MINIRV32_DOP_DIV: case MINIRV32_DOP_DIVU: case MINIRV32_DOP_REM: case MINIRV32_DOP_REMU:
+				{
+					uint32_t rs1 = REG( dec->rs1 );
+					uint32_t rs2 = REG( dec->rs2 );
+					switch( dec->op )
+					{
+						case MINIRV32_DOP_DIV: if( rs2 == 0 ) rval = -1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2); break;
+						case MINIRV32_DOP_DIVU: if( rs2 == 0 ) rval = 0xffffffff; else rval = rs1 / rs2; break;
+						case MINIRV32_DOP_REM: if( rs2 == 0 ) rval = rs1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((uint32_t)((int32_t)rs1 % (int32_t)rs2)); break;
+						default: if( rs2 == 0 ) rval = rs1; else rval = rs1 % rs2; break;
+					}
+					break;
+				}
+#ifdef MINIRV32_ZB
+				case MINIRV32_DOP_BITMANIP:
+					MiniRV32IMABitmanip( ir, REG( dec->rs1 ), ( ir & 0x20 ) ? REG( dec->rs2 ) : (uint32_t)dec->imm, &rval );
+					break;
+#endif
+#ifdef MINIRV32_FUSION
+				// Both halves count as instructions, so a pair never straddles the
+				// end of a Step(), and nothing can interrupt it.  None of the first
+				// halves can trap.  Leaves pc at the second instruction.
+				#define MINIRV32_FUSED_PAIR \
+					if( icount + 1 >= count ) { slowpath = 1; break; } \
+					MINIRV32_DECODE_CACHE_PTR->fused[dec->op - MINIRV32_DOP_FUSE_LUI_ADDI]++; \
+					pc += 4; cycle++; icount++;
+				case MINIRV32_DOP_FUSE_LUI_ADDI: case MINIRV32_DOP_FUSE_AUIPC_ADDI:
+					MINIRV32_FUSED_PAIR
+					REGSET( dec->rd, dec->imm );
+					rval = dec->imm2; rdid = dec->rd2;
+					break;
+				case MINIRV32_DOP_FUSE_AUIPC_JALR:
+					MINIRV32_FUSED_PAIR
+					REGSET( dec->rd, dec->imm );
+					rval = pc + 4; rdid = dec->rd2;
+					pc = dec->imm2;
+					break;
+				case MINIRV32_DOP_FUSE_SLLI_SRLI:
+					MINIRV32_FUSED_PAIR
+					rval = REG( dec->rs1 ) << dec->imm;
+					REGSET( dec->rd, rval );
+					rval >>= dec->imm2; rdid = dec->rd2;
+					break;
+				case MINIRV32_DOP_FUSE_SLT_BR:
+					MINIRV32_FUSED_PAIR
+					rval = (int32_t)REG( dec->rs1 ) < (int32_t)REG( dec->rs2 );
+					if( rval != dec->rd2 ) pc = dec->imm2;
+					break;
+				case MINIRV32_DOP_FUSE_SLTU_BR:
+					MINIRV32_FUSED_PAIR
+					rval = REG( dec->rs1 ) < REG( dec->rs2 );
+					if( rval != dec->rd2 ) pc = dec->imm2;
+					break;
+				case MINIRV32_DOP_FUSE_SLTI_BR:
+					MINIRV32_FUSED_PAIR
+					rval = (int32_t)REG( dec->rs1 ) < dec->imm;
+					if( rval != dec->rd2 ) pc = dec->imm2;
+					break;
+				case MINIRV32_DOP_FUSE_SLTIU_BR:
+					MINIRV32_FUSED_PAIR
+					rval = REG( dec->rs1 ) < (uint32_t)dec->imm;
+					if( rval != dec->rd2 ) pc = dec->imm2;
+					break;
+				#undef MINIRV32_FUSED_PAIR
+#endif
+				default: slowpath = 1; break;
+			}
+
+#ifdef MINIRV32_BLOCK_CACHE
+			// Go straight on to the next instruction, in this block or a block
+			// it is chained to, skipping the fetch checks and trap handling.
+			// Calls and returns go the long way, through the RAS.
+			if( !slowpath && icount + 1 < count )
+			{
+#ifndef MINIRV32_JIT // With the JIT, leave blocks through the top of the loop, to run translated code.
+				if( nextop->pc != pc + 4 && !blk->exitkind )
+				{
+					struct MiniRV32IMABlock * b = blk->next[pc + 4 != blk->endpc];
+					if( b->ops[0].pc == pc + 4 )
+					{
+						blk = b;
+						nextop = b->ops;
+					}
+				}
+#endif
+				if( nextop->pc == pc + 4 )
+				{
+					if( rdid ) REGSET( rdid, rval );
+					rval = 0;
+					pc += 4;
+					cycle++;
+					icount++;
+					dec = nextop++;
+					goto nextblockop;
+				}
+			}
+#endif
+
+			if( slowpath )
+#else
+#ifdef MINIRV32_RVC
+			ir = MINIRV32_LOAD2( ofs_pc );
+			if( ( ir & 3 ) != 3 )
+			{
+				// See MiniRV32IMAExpandC(), this makes "pc += 4" land after it.
+				ir = MiniRV32IMAExpandC( ir );
+				pc -= 2;
+				rvc = 2;
+			}
+			else if( ofs_pc >= MINI_RV32_RAM_SIZE-3 )
+			{
+				trap = 1 + 1;
+				break;
+			}
+			else
+				ir |= MINIRV32_LOAD2( ofs_pc + 2 ) << 16;
+#else
 			ir = MINIRV32_LOAD4( ofs_pc );
+#endif
 			uint32_t rdid = (ir >> 7) & 0x1f;
-
-			switch( ir & 0x7f )
+#endif
+			MINIRV32_SWITCH( op, ir & 0x7f )
 			{
-				case 0x37: // LUI (0b0110111)
+				MINIRV32_CASE( op, 0x37 ): // LUI (0b0110111)
 					rval = ( ir & 0xfffff000 );
 					break;
-				case 0x17: // AUIPC (0b0010111)
+				MINIRV32_CASE( op, 0x17 ): // AUIPC (0b0010111)
 					rval = pc + ( ir & 0xfffff000 );
 					break;
-				case 0x6F: // JAL (0b1101111)
+				MINIRV32_CASE( op, 0x6F ): // JAL (0b1101111)
 				{
 					int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
 					if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
@@ -188,7 +1562,7 @@ MINIRV32_STEPPROTO
 					pc = pc + reladdy - 4;
 					break;
 				}
-				case 0x67: // JALR (0b1100111)
+				MINIRV32_CASE( op, 0x67 ): // JALR (0b1100111)
 				{
 					uint32_t imm = ir >> 20;
 					int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
@@ -196,7 +1570,7 @@ MINIRV32_STEPPROTO
 					pc = ( (REG( (ir >> 15) & 0x1f ) + imm_se) & ~1) - 4;
 					break;
 				}
-				case 0x63: // Branch (0b1100011)
+				MINIRV32_CASE( op, 0x63 ): // Branch (0b1100011)
 				{
 					uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
 					if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
@@ -217,7 +1591,7 @@ MINIRV32_STEPPROTO
 					}
 					break;
 				}
-				case 0x03: // Load (0b0000011)
+				MINIRV32_CASE( op, 0x03 ): // Load (0b0000011)
 				{
 					uint32_t rs1 = REG((ir >> 15) & 0x1f);
 					uint32_t imm = ir >> 20;
@@ -225,7 +1599,7 @@ MINIRV32_STEPPROTO
 					uint32_t rsval = rs1 + imm_se;
 
 					rsval -= MINIRV32_RAM_IMAGE_OFFSET;
-					if( rsval >= MINI_RV32_RAM_SIZE-3 )
+					if( MINIRV32_GUARD_CHECK( rsval >= MINI_RV32_RAM_SIZE-3 ) )
 					{
 						rsval += MINIRV32_RAM_IMAGE_OFFSET;
 						if( MINIRV32_MMIO_RANGE( rsval ) )  // UART, CLNT
@@ -240,6 +1614,7 @@ MINIRV32_STEPPROTO
 					}
 					else
 					{
+						MINIRV32_GUARD_MARK();
 						switch( ( ir >> 12 ) & 0x7 )
 						{
 							//LB, LH, LW, LBU, LHU
@@ -253,7 +1628,7 @@ MINIRV32_STEPPROTO
 					}
 					break;
 				}
-				case 0x23: // Store 0b0100011
+				MINIRV32_CASE( op, 0x23 ): // Store 0b0100011
 				{
 					uint32_t rs1 = REG((ir >> 15) & 0x1f);
 					uint32_t rs2 = REG((ir >> 20) & 0x1f);
@@ -262,7 +1637,7 @@ MINIRV32_STEPPROTO
 					addy += rs1 - MINIRV32_RAM_IMAGE_OFFSET;
 					rdid = 0;
 
-					if( addy >= MINI_RV32_RAM_SIZE-3 )
+					if( MINIRV32_GUARD_CHECK( addy >= MINI_RV32_RAM_SIZE-3 ) )
 					{
 						addy += MINIRV32_RAM_IMAGE_OFFSET;
 						if( MINIRV32_MMIO_RANGE( addy ) )
@@ -277,6 +1652,7 @@ MINIRV32_STEPPROTO
 					}
 					else
 					{
+						MINIRV32_GUARD_MARK();
 						switch( ( ir >> 12 ) & 0x7 )
 						{
 							//SB, SH, SW
@@ -285,11 +1661,12 @@ MINIRV32_STEPPROTO
 							case 2: MINIRV32_STORE4( addy, rs2 ); break;
 							default: trap = (2+1);
 						}
+						MINIRV32_DECODE_CACHE_STORE( addy );
 					}
 					break;
 				}
-				case 0x13: // Op-immediate 0b0010011
-				case 0x33: // Op           0b0110011
+				MINIRV32_CASE( op, 0x13 ): // Op-immediate 0b0010011
+				MINIRV32_CASE( op, 0x33 ): // Op           0b0110011
 				{
 					uint32_t imm = ir >> 20;
 					imm = imm | (( imm & 0x800 )?0xfffff000:0);
@@ -297,6 +1674,11 @@ MINIRV32_STEPPROTO
 					uint32_t is_reg = !!( ir & 0x20 );
 					uint32_t rs2 = is_reg ? REG(imm & 0x1f) : imm;
 
+#ifdef MINIRV32_ZB
+					if( MiniRV32IMABitmanip( ir, rs1, rs2, &rval ) )
+						; // Zba, Zbb or Zbs.
+					else
+#endif
 					if( is_reg && ( ir & 0x02000000 ) )
 					{
 						switch( (ir>>12)&7 ) //0x02000000 = RV32M
@@ -331,10 +1713,14 @@ MINIRV32_STEPPROTO
 					}
 					break;
 				}
-				case 0x0f: // 0b0001111
+				MINIRV32_CASE( op, 0x0f ): // 0b0001111
 					rdid = 0;   // fencetype = (ir >> 12) & 0b111; We ignore fences in this impl.
+#ifdef MINIRV32_DECODE_CACHE
+					if( ( ( ir >> 12 ) & 0x7 ) == 1 ) // Except FENCE.I, in case code was changed behind our back.
+						MiniRV32IMAFlushDecodeCache( MINIRV32_DECODE_CACHE_PTR );
+#endif
 					break;
-				case 0x73: // Zifencei+Zicsr  (0b1110011)
+				MINIRV32_CASE( op, 0x73 ): // Zifencei+Zicsr  (0b1110011)
 				{
 					uint32_t csrno = ir >> 20;
 					uint32_t microop = ( ir >> 12 ) & 0x7;
@@ -358,7 +1744,13 @@ MINIRV32_STEPPROTO
 						case 0x342: rval = CSR( mcause ); break;
 						case 0x343: rval = CSR( mtval ); break;
 						case 0xf11: rval = 0xff0ff0ff; break; //mvendorid
-						case 0x301: rval = 0x40401101; break; //misa (XLEN=32, IMA+X)
+#ifdef MINIRV32_FPU
+						case 0x001: case 0x002: case 0x003: // fflags, frm, fcsr
+							if( !( CSR( mstatus ) & 0x6000 ) ) { trap = (2+1); break; } // FS is off.
+							rval = ( csrno == 1 ) ? ( CSR( fcsr ) & 0x1f ) : ( csrno == 2 ) ? ( CSR( fcsr ) >> 5 ) : CSR( fcsr );
+							break;
+#endif
+						case 0x301: rval = 0x40401101 | MINIRV32_MISA_FD | MINIRV32_MISA_C | MINIRV32_MISA_B; break; //misa (XLEN=32, IMA+X, FD, C, B)
 						//case 0x3B0: rval = 0; break; //pmpaddr0
 						//case 0x3a0: rval = 0; break; //pmpcfg0
 						//case 0xf12: rval = 0x00000000; break; //marchid
@@ -389,6 +1781,16 @@ MINIRV32_STEPPROTO
 						case 0x300: SETCSR( mstatus, writeval ); break; //mstatus
 						case 0x342: SETCSR( mcause, writeval ); break;
 						case 0x343: SETCSR( mtval, writeval ); break;
+#ifdef MINIRV32_FPU
+						case 0x001: case 0x002: case 0x003:
+							if( trap ) break;
+							if( csrno == 1 ) writeval = ( CSR( fcsr ) & 0xe0 ) | ( writeval & 0x1f );
+							else if( csrno == 2 ) writeval = ( CSR( fcsr ) & 0x1f ) | ( ( writeval & 7 ) << 5 );
+							SETCSR( fcsr, writeval & 0xff );
+							CSR( mstatus ) |= 0x6000; // FS = dirty.
+							MINIRV32_FPU_CLEARFLAGS(); // They're in fcsr now.
+							break;
+#endif
 						//case 0x3a0: break; //pmpcfg0
 						//case 0x3B0: break; //pmpaddr0
 						//case 0xf11: break; //mvendorid
@@ -411,7 +1813,7 @@ MINIRV32_STEPPROTO
 							// Should also update mstatus to reflect correct mode.
 							uint32_t startmstatus = CSR( mstatus );
 							uint32_t startextraflags = CSR( extraflags );
-							SETCSR( mstatus , (( startmstatus & 0x80) >> 4) | ((startextraflags&3) << 11) | 0x80 );
+							SETCSR( mstatus , (( startmstatus & 0x80) >> 4) | ((startextraflags&3) << 11) | 0x80 | ( startmstatus & MINIRV32_MSTATUS_KEEP ) );
 							SETCSR( extraflags, (startextraflags & ~3) | ((startmstatus >> 11) & 3) );
 							pc = CSR( mepc ) -4;
 						} else {
@@ -435,7 +1837,7 @@ MINIRV32_STEPPROTO
 						trap = (2+1); 				// Note micrrop 0b100 == undefined.
 					break;
 				}
-				case 0x2f: // RV32A (0b00101111)
+				MINIRV32_CASE( op, 0x2f ): // RV32A (0b00101111)
 				{
 					uint32_t rs1 = REG((ir >> 15) & 0x1f);
 					uint32_t rs2 = REG((ir >> 20) & 0x1f);
@@ -445,13 +1847,14 @@ MINIRV32_STEPPROTO
 
 					// We don't implement load/store from UART or CLNT with RV32A here.
 
-					if( rs1 >= MINI_RV32_RAM_SIZE-3 )
+					if( MINIRV32_GUARD_CHECK( rs1 >= MINI_RV32_RAM_SIZE-3 ) )
 					{
 						trap = (7+1); //Store/AMO access fault
 						rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
 					}
 					else
 					{
+						MINIRV32_GUARD_MARK();
 						rval = MINIRV32_LOAD4( rs1 );
 
 						// Referenced a little bit of https://github.com/franzflasch/riscv_em/blob/master/src/core/core.c
@@ -477,15 +1880,86 @@ MINIRV32_STEPPROTO
 							case 28: rs2 = (rs2>rval)?rs2:rval; break; //AMOMAXU.W (0b11100)
 							default: trap = (2+1); dowrite = 0; break; //Not supported.
 						}
-						if( dowrite ) MINIRV32_STORE4( rs1, rs2 );
+						if( dowrite ) { MINIRV32_STORE4( rs1, rs2 ); MINIRV32_DECODE_CACHE_STORE( rs1 ); }
 					}
 					break;
 				}
-				default: trap = (2+1); // Fault: Invalid opcode.
+#ifdef MINIRV32_FPU
+				MINIRV32_CASE( op, 0x07 ): // LOAD-FP (0b0000111)
+				MINIRV32_CASE( op, 0x27 ): // STORE-FP (0b0100111)
+				{
+					uint32_t funct3 = ( ir >> 12 ) & 7;
+					uint32_t imm = ( ir & 0x20 ) ? ( ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 ) ) : ( ir >> 20 );
+					uint32_t addy = REG( ( ir >> 15 ) & 0x1f ) + ( imm | ( ( imm & 0x800 ) ? 0xfffff000 : 0 ) ) - MINIRV32_RAM_IMAGE_OFFSET;
+					rdid = 0;
+					if( ( funct3 != 2 && funct3 != 3 ) || !( CSR( mstatus ) & 0x6000 ) )
+						trap = (2+1); // Only FLW, FLD, FSW, FSD, and only with FS on.
+					else if( addy >= MINI_RV32_RAM_SIZE - ( ( funct3 == 3 ) ? 7 : 3 ) )
+					{
+						// No FP access to MMIO.
+						trap = ( ir & 0x20 ) ? (7+1) : (5+1);
+						rval = addy + MINIRV32_RAM_IMAGE_OFFSET;
+					}
+					else if( ir & 0x20 )
+					{
+						uint64_t v = FREG( ( ir >> 20 ) & 0x1f );
+						MINIRV32_STORE4( addy, (uint32_t)v );
+						MINIRV32_DECODE_CACHE_STORE( addy );
+						if( funct3 == 3 )
+						{
+							MINIRV32_STORE4( addy + 4, (uint32_t)( v >> 32 ) );
+							MINIRV32_DECODE_CACHE_STORE( addy + 4 );
+						}
+					}
+					else
+					{
+						uint64_t v = MINIRV32_LOAD4( addy );
+						v |= ( funct3 == 3 ) ? ( (uint64_t)MINIRV32_LOAD4( addy + 4 ) << 32 ) : 0xffffffff00000000ull;
+						FREGSET( ( ir >> 7 ) & 0x1f, v );
+						CSR( mstatus ) |= 0x6000;
+					}
+					break;
+				}
+				MINIRV32_CASE( op, 0x43 ): // FMADD (0b1000011)
+				MINIRV32_CASE( op, 0x47 ): // FMSUB (0b1000111)
+				MINIRV32_CASE( op, 0x4b ): // FNMSUB (0b1001011)
+				MINIRV32_CASE( op, 0x4f ): // FNMADD (0b1001111)
+				MINIRV32_CASE( op, 0x53 ): // OP-FP (0b1010011)
+				{
+					uint32_t fcsr = CSR( fcsr );
+					uint64_t result;
+					int r;
+					if( !( CSR( mstatus ) & 0x6000 ) )
+					{
+						trap = (2+1);
+						break;
+					}
+					r = MiniRV32IMAFpuOp( ir, FREG( ( ir >> 15 ) & 0x1f ), FREG( ( ir >> 20 ) & 0x1f ), FREG( ir >> 27 ), REG( ( ir >> 15 ) & 0x1f ), &fcsr, &result );
+					if( r < 0 )
+					{
+						trap = (2+1);
+						break;
+					}
+					SETCSR( fcsr, fcsr );
+					CSR( mstatus ) |= 0x6000;
+					if( r )
+						rval = (uint32_t)result;
+					else
+					{
+						FREGSET( rdid, result );
+						rdid = 0;
+					}
+					break;
+				}
+#endif
+				MINIRV32_DEFAULT( op ): trap = (2+1); // Fault: Invalid opcode.
 			}
 
 			// If there was a trap, do NOT allow register writeback.
 			if( trap ) {
+#ifdef MINIRV32_RVC
+				pc += rvc; // mepc is where the instruction really is.
+#endif
 				SETCSR( pc, pc );
 				MINIRV32_POSTEXEC( pc, ir, trap );
 				break;
@@ -519,7 +1993,7 @@ MINIRV32_STEPPROTO
 		SETCSR( mepc, pc ); //TRICKY: The kernel advances mepc automatically.
 		//CSR( mstatus ) & 8 = MIE, & 0x80 = MPIE
 		// On an interrupt, the system moves current MIE into MPIE
-		SETCSR( mstatus, (( CSR( mstatus ) & 0x08) << 4) | (( CSR( extraflags ) & 3 ) << 11) );
+		SETCSR( mstatus, (( CSR( mstatus ) & 0x08) << 4) | (( CSR( extraflags ) & 3 ) << 11) | ( CSR( mstatus ) & MINIRV32_MSTATUS_KEEP ) );
 		pc = (CSR( mtvec ) - 4);
 
 		// If trapping, always enter machine mode.
@@ -535,6 +2009,194 @@ MINIRV32_STEPPROTO
 	return 0;
 }
 
+#ifdef MINIRV32_FAST_FORWARD
+
+#ifndef MINIRV32_FAST_FORWARD_MAX_LOOP
+	#define MINIRV32_FAST_FORWARD_MAX_LOOP 16 // Longest loop considered, in instructions.
+#endif
+
+MINIRV32_DECORATE int32_t MiniRV32IMAFastForward( struct MiniRV32IMAState * state, uint8_t * image, uint32_t maxskip )
+{
+	uint32_t pc = CSR( pc );
+	uint32_t ofs_pc = pc - MINIRV32_RAM_IMAGE_OFFSET;
+	uint32_t tail, head, len, ir, i;
+	uint32_t written = 0; // Registers the loop writes.
+	uint32_t nonlinear = 0; // ... with anything other than rd += invariant.
+	uint32_t needinvariant = 0; // Registers that have to not be written for the deltas to hold.
+	int hasload = 0;
+	uint32_t delta[32] = { 0 };
+	uint32_t before[32];
+	int32_t ret;
+
+	if( ofs_pc >= MINI_RV32_RAM_SIZE-3 || ( ofs_pc & 3 ) )
+		return 0;
+
+	// Find the branch that closes the loop, and the top of the loop.
+	for( tail = ofs_pc; ; tail += 4 )
+	{
+		if( tail >= MINI_RV32_RAM_SIZE-3 || tail - ofs_pc >= MINIRV32_FAST_FORWARD_MAX_LOOP*4 )
+			return 0;
+		ir = MINIRV32_LOAD4( tail );
+		if( ( ir & 3 ) != 3 )
+			return 0; // Compressed.
+		if( ( ir & 0x7f ) == 0x63 )
+			break;
+	}
+	{
+		uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
+		if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
+		head = tail + immm4;
+		if( ( immm4 & 0x80000000 ) == 0 || head > ofs_pc || tail - head >= MINIRV32_FAST_FORWARD_MAX_LOOP*4 || ( head & 3 ) ||
+			( ( ir >> 12 ) & 0x6 ) == 2 )
+			return 0;
+	}
+	len = ( tail - head ) / 4 + 1;
+
+	// Everything before the branch has to be side effect free.
+	for( i = head; i < tail; i += 4 )
+	{
+		uint32_t rd, rs1, rs2, funct3;
+		ir = MINIRV32_LOAD4( i );
+		rd = ( ir >> 7 ) & 0x1f;
+		rs1 = ( ir >> 15 ) & 0x1f;
+		rs2 = ( ir >> 20 ) & 0x1f;
+		funct3 = ( ir >> 12 ) & 7;
+		switch( ir & 0x7f )
+		{
+			case 0x13: // Op-immediate
+				if( funct3 == 0 && rd == rs1 )
+					delta[rd] += (int32_t)ir >> 20;
+				else
+					nonlinear |= 1<<rd;
+				break;
+			case 0x33: // Op, including M.
+				if( ( ir >> 25 ) == 0 && funct3 == 0 && rd == rs1 )
+					delta[rd] += REG( rs2 ), needinvariant |= 1<<rs2;
+				else if( ( ir >> 25 ) == 0x20 && funct3 == 0 && rd == rs1 )
+					delta[rd] -= REG( rs2 ), needinvariant |= 1<<rs2;
+				else
+					nonlinear |= 1<<rd;
+				break;
+			case 0x37: case 0x17: // LUI, AUIPC
+				nonlinear |= 1<<rd;
+				break;
+			case 0x03: // Load
+				if( funct3 == 3 || funct3 > 5 )
+					return 0;
+				nonlinear |= 1<<rd;
+				hasload = 1; // Might be MMIO, can't skip those.
+				break;
+			case 0x0f: // FENCE, but not FENCE.I
+				if( funct3 )
+					return 0;
+				rd = 0;
+				break;
+			default:
+				return 0;
+		}
+		written |= 1<<rd;
+	}
+	written &= ~1;
+	nonlinear &= ~1;
+
+	// Get to the top of the loop.
+	if( ofs_pc != head )
+	{
+		ret = MiniRV32IMAStep( state, image, 0, 0, ( tail - ofs_pc ) / 4 + 1 );
+		if( ret || CSR( pc ) != head + MINIRV32_RAM_IMAGE_OFFSET )
+			return ret;
+	}
+
+	ir = MINIRV32_LOAD4( tail );
+	if( !nonlinear && !hasload && !( needinvariant & written ) )
+	{
+		// Every register changes by the same amount each time around, so we
+		// can work out how many more times the branch will be taken.  The
+		// branch sees a + da * t vs b + db * t, for t = 1, 2, ...
+		uint32_t rs1 = ( ir >> 15 ) & 0x1f, rs2 = ( ir >> 20 ) & 0x1f;
+		uint32_t funct3 = ( ir >> 12 ) & 7;
+		uint64_t skip = 0; // Iterations to skip.
+		uint64_t cycle;
+		if( funct3 < 2 )
+		{
+			// BEQ, BNE: exact, mod 2^32.  Solve u + s * t == 0.
+			uint32_t u = REG( rs1 ) - REG( rs2 );
+			uint32_t s = delta[rs1] - delta[rs2];
+			uint64_t hit = ~0ULL; // First t >= 1 where they're equal.
+			if( s == 0 )
+				hit = u ? ~0ULL : 1;
+			else
+			{
+				uint32_t v = 0;
+				while( !( ( s >> v ) & 1 ) ) v++;
+				if( !( u & ( ( 1u << v ) - 1 ) ) )
+				{
+					// s = so * 2^v, with so odd, so it has an inverse mod 2^32.
+					uint32_t so = s >> v, inv = so;
+					for( i = 0; i < 5; i++ ) inv *= 2 - so * inv;
+					hit = ( ( 0 - ( u >> v ) ) * inv ) & ( 0xffffffffu >> v );
+					if( !hit ) hit = 1ULL << ( 32 - v );
+				}
+			}
+			if( funct3 == 0 ) // BEQ is only ever taken more than once if it's taken forever.
+				skip = ( u == 0 && s == 0 ) ? ~0ULL : 0;
+			else
+				skip = hit - 1;
+		}
+		else
+		{
+			// Ordered compares: a + da * t and b + db * t as 64-bit lines, as
+			// long as neither one wraps around.
+			int issigned = funct3 < 6;
+			int64_t a = issigned ? (int64_t)(int32_t)REG( rs1 ) : (int64_t)REG( rs1 );
+			int64_t b = issigned ? (int64_t)(int32_t)REG( rs2 ) : (int64_t)REG( rs2 );
+			int64_t da = (int32_t)delta[rs1], db = (int32_t)delta[rs2];
+			int64_t lo = issigned ? INT32_MIN : 0, hi = issigned ? INT32_MAX : 0xffffffffLL;
+			int64_t u = a - b, s = da - db;
+			uint64_t tmax = ~0ULL; // Last t with both in range.
+			if( da > 0 ) tmax = ( hi - a ) / da;
+			if( da < 0 && (uint64_t)( ( a - lo ) / -da ) < tmax ) tmax = ( a - lo ) / -da;
+			if( db > 0 && (uint64_t)( ( hi - b ) / db ) < tmax ) tmax = ( hi - b ) / db;
+			if( db < 0 && (uint64_t)( ( b - lo ) / -db ) < tmax ) tmax = ( b - lo ) / -db;
+			if( funct3 & 1 ) // BGE: taken while u + s * t >= 0, flip it around.
+				u = -u - 1, s = -s;
+			// Now taken while u + s * t < 0.
+			if( u + s >= 0 || tmax == 0 )
+				skip = 0;
+			else if( s > 0 )
+				skip = ( -u + s - 1 ) / s - 1; // First t where it falls out, minus one.
+			else
+				skip = ~0ULL;
+			if( skip > tmax - 1 )
+				skip = tmax - 1;
+		}
+
+		if( skip > maxskip / len )
+			skip = maxskip / len;
+		if( !skip )
+			return 0;
+		for( i = 1; i < 32; i++ )
+			REGSET( i, REG( i ) + delta[i] * (uint32_t)skip );
+		cycle = ( ( (uint64_t)CSR( cycleh ) << 32 ) | CSR( cyclel ) ) + skip * len;
+		SETCSR( cyclel, (uint32_t)cycle );
+		SETCSR( cycleh, (uint32_t)( cycle >> 32 ) );
+		return 0;
+	}
+
+	// Go around once more, if nothing changed it never will.
+	for( i = 0; i < 32; i++ )
+		before[i] = REG( i );
+	ret = MiniRV32IMAStep( state, image, 0, 0, len );
+	if( ret || CSR( pc ) != head + MINIRV32_RAM_IMAGE_OFFSET )
+		return ret;
+	for( i = 0; i < 32; i++ )
+		if( before[i] != REG( i ) )
+			return 0;
+	return 1;
+}
+
+#endif
+
 #endif
 
 #endif
@@ -0,0 +1,143 @@
+// Copyright 2022 Charles Lohr, you may use this file or any portions herein under any of the BSD, MIT, or CC0 licenses.
+
+#ifndef _MINI_RV32IMA_HPP
+#define _MINI_RV32IMA_HPP
+
+/**
+    C++ front for mini-rv32ima.h.  Instead of wiring the core up with macros
+	that point at globals, the memory map and the I/O are template parameters:
+
+	struct MyConfig : rv32::DefaultConfig
+	{
+		static constexpr uint32_t ram_size = 16*1024*1024;
+	};
+
+	struct MyBus : rv32::NullBus
+	{
+		uint32_t Store( MiniRV32IMAState & s, uint32_t addy, uint32_t val ) { ... }
+	};
+
+	rv32::Core< MyConfig, MyBus > core( ram );
+	core.Step( 0, elapsedUs, 1024 );
+
+	RAM size, RAM base and the MMIO window are constexpr, so all the bounds
+	checks compile down to immediates.  Bus and Hooks are called directly and
+	are inlined, there are no function pointers or virtuals in the step loop.
+
+	Notes:
+		* This instantiates the same step loop as the C build, so it behaves
+		  exactly the same for the same device model.
+		* Only one translation unit per program may include this header, and it
+		  can't be combined with MINIRV32_IMPLEMENTATION of the C core.
+		* The decode/block caches and the JIT keep global, non-template state
+		  and aren't available here.
+
+	Bus (all optional, see NullBus):
+		uint32_t Load( MiniRV32IMAState & s, uint32_t addy );
+		uint32_t Store( MiniRV32IMAState & s, uint32_t addy, uint32_t val );
+			Nonzero return leaves Step() with that value, like a syscon.  The
+			cycle count is saved first, the PC is not.
+
+	Hooks (all optional, see NullHooks):
+		int32_t CSRRead( MiniRV32IMAState & s, uint8_t * image, uint16_t csrno );
+		void CSRWrite( MiniRV32IMAState & s, uint8_t * image, uint16_t csrno, uint32_t value );
+		int32_t PostExec( MiniRV32IMAState & s, uint32_t pc, uint32_t ir, uint32_t & trap );
+			Nonzero return leaves Step() with that value.
+*/
+
+#include <stdint.h>
+
+#if defined( MINIRV32_IMPLEMENTATION ) || defined( _MINI_RV32IMAH_H )
+#error mini-rv32ima.hpp must be included before, and instead of, the C implementation.
+#endif
+
+#if defined( MINIRV32_DECODE_CACHE ) || defined( MINIRV32_BLOCK_CACHE ) || defined( MINIRV32_JIT )
+#error The template core does not support the decode cache, block cache or JIT.
+#endif
+
+#ifdef MINIRV32_FAST_FORWARD
+#error MiniRV32IMAFastForward() needs the C MiniRV32IMAStep().
+#endif
+
+#if defined( MINIRV32_CUSTOM_INTERNALS ) || defined( MINIRV32_CUSTOM_MEMORY_BUS )
+#error The template core owns the state and memory bus, use the Bus and Hooks policies instead.
+#endif
+
+namespace rv32
+{
+
+struct DefaultConfig
+{
+	static constexpr uint32_t ram_base = 0x80000000;
+	static constexpr uint32_t ram_size = 64*1024*1024;
+	static constexpr uint32_t mmio_base = 0x10000000;
+	static constexpr uint32_t mmio_end = 0x12000000;
+};
+
+struct NullBus
+{
+	template< class S > uint32_t Load( S &, uint32_t ) { return 0; }
+	template< class S > uint32_t Store( S &, uint32_t, uint32_t ) { return 0; }
+};
+
+struct NullHooks
+{
+	template< class S > int32_t CSRRead( S &, uint8_t *, uint16_t ) { return 0; }
+	template< class S > void CSRWrite( S &, uint8_t *, uint16_t, uint32_t ) { }
+	template< class S > int32_t PostExec( S &, uint32_t, uint32_t, uint32_t & ) { return 0; }
+};
+
+}
+
+// Inlining the whole step loop into the caller's run loop costs registers, and
+// measured about 10% slower.
+#if defined( __GNUC__ )
+#define MINIRV32_TEMPLATE_NOINLINE __attribute__((noinline))
+#elif defined( _MSC_VER )
+#define MINIRV32_TEMPLATE_NOINLINE __declspec(noinline)
+#else
+#define MINIRV32_TEMPLATE_NOINLINE
+#endif
+
+// Map the C core's hooks onto the policies.  "state", "image", "bus" and "hooks"
+// are the parameters of the step function below, Config is its template argument.
+#define MINI_RV32_RAM_SIZE ( Config::ram_size )
+#define MINIRV32_RAM_IMAGE_OFFSET ( Config::ram_base )
+#define MINIRV32_MMIO_RANGE( n ) ( Config::mmio_base <= (n) && (n) < Config::mmio_end )
+#define MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, val ) { uint32_t r = bus.Store( *state, addy, val ); if( r ) { if( CSR( cyclel ) > cycle ) CSR( cycleh )++; SETCSR( cyclel, cycle ); return r; } }
+#define MINIRV32_HANDLE_MEM_LOAD_CONTROL( addy, rval ) rval = bus.Load( *state, addy );
+#define MINIRV32_OTHERCSR_WRITE( csrno, value ) hooks.CSRWrite( *state, image, csrno, value );
+#define MINIRV32_OTHERCSR_READ( csrno, value ) value = hooks.CSRRead( *state, image, csrno );
+#define MINIRV32_POSTEXEC( pc, ir, trap ) { int32_t r = hooks.PostExec( *state, pc, ir, trap ); if( r ) return r; }
+#define MINIRV32_STEPPROTO template< class Config, class Bus, class Hooks > static MINIRV32_TEMPLATE_NOINLINE int32_t MiniRV32IMAStepT( \
+	struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count, Bus & bus, Hooks & hooks )
+#define MINIRV32_IMPLEMENTATION
+
+#include "mini-rv32ima.h"
+
+namespace rv32
+{
+
+template< class Config = DefaultConfig, class Bus = NullBus, class Hooks = NullHooks >
+struct Core
+{
+	static_assert( Config::ram_size > sizeof( MiniRV32IMAState ), "RAM must be able to hold something" );
+
+	MiniRV32IMAState state;
+	uint8_t * image; // Config::ram_size bytes, mapped at Config::ram_base.
+	Bus bus;
+	Hooks hooks;
+
+	Core( uint8_t * image ) : state(), image( image ), bus(), hooks() { }
+
+	// Same return codes as MiniRV32IMAStep(), plus whatever Bus::Store or
+	// Hooks::PostExec return.
+	int32_t Step( uint32_t vProcAddress, uint32_t elapsedUs, int count )
+	{
+		return MiniRV32IMAStepT< Config, Bus, Hooks >( &state, image, vProcAddress, elapsedUs, count, bus, hooks );
+	}
+};
+
+}
+
+#endif